@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "files.hpp"
+#include "record.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+struct LogFileEntry
+{
+    // Milliseconds since the epoch
+    int64_t time = 0;
+    string path;
+    uint64_t size = 0;
+    HttpMethod method = HttpMethod::Other;
+};
+
+// Totals of the per-request log files in the logs directory, kept in
+// memory so the status bar and metrics read them in O(1). A scan seeds
+// them at startup, then the log writer adds every file it writes.
+class LogAccounting
+{
+private:
+    atomic<uint64_t> files[HTTP_METHOD_COUNT];
+    atomic<uint64_t> bytes[HTTP_METHOD_COUNT];
+
+    // Every file, oldest first, only kept when tracking
+    bool tracking = false;
+    mutex mtx;
+    deque<LogFileEntry> entries;
+
+public:
+    LogAccounting();
+    LogAccounting(const LogAccounting &) = delete;
+
+    // Keeps an entry per file besides the totals, so retention can evict
+    // the oldest. Called before seed.
+    void trackFiles();
+
+    // Replaces the totals with those of `directory` and its `layout`
+    // shards, statting its entries on up to `threads` threads
+    void seed(const string &directory, LogLayout layout, unsigned threads);
+
+    // A file written at `time`, in milliseconds
+    void add(const string &path, HttpMethod method, uint64_t size, int64_t time);
+
+    // Takes the oldest tracked file out of the totals, false if none is left
+    bool popOldest(LogFileEntry &entry);
+
+    // Time of the oldest tracked file, 0 if there is none
+    int64_t oldestTime();
+
+    uint64_t fileCount();
+    uint64_t byteCount();
+    uint64_t fileCount(HttpMethod method);
+    uint64_t byteCount(HttpMethod method);
+};
+
+// Method a log file was written for, from the name's "GET_" prefix
+HttpMethod logFileMethod(const string &name);
+
+LogAccounting::LogAccounting()
+{
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+    {
+        files[m] = 0;
+        bytes[m] = 0;
+    }
+}
+
+HttpMethod logFileMethod(const string &name)
+{
+    size_t end = name.find('_');
+    return httpMethodFromString(end == string::npos ? "" : name.substr(0, end));
+}
+
+void LogAccounting::seed(const string &directory, LogLayout layout, unsigned threads)
+{
+    // Listing is sequential, the stats are what's worth spreading
+    vector<string> names;
+    forEachLogFile(directory, layout, [&](const filesystem::path &path)
+                   {
+        if (!isCallLogFile(path))
+            names.push_back(path.string()); });
+
+    const size_t minPerThread = 4096;
+    size_t count = names.size() / minPerThread + 1;
+    if (count > threads)
+        count = threads > 0 ? threads : 1;
+
+    vector<uint64_t> found(count * HTTP_METHOD_COUNT * 2, 0);
+    vector<LogFileEntry> scanned(tracking ? names.size() : 0);
+    vector<thread> scanners;
+
+    for (size_t t = 0; t < count; t++)
+    {
+        scanners.emplace_back([&, t]
+                              {
+            uint64_t *local = &found[t * HTTP_METHOD_COUNT * 2];
+            struct stat st;
+            for (size_t i = t; i < names.size(); i += count)
+            {
+                if (::stat(names[i].c_str(), &st) != 0)
+                    continue;
+
+                HttpMethod method = logFileMethod(filesystem::path(names[i]).filename().string());
+                local[(int)method * 2]++;
+                local[(int)method * 2 + 1] += st.st_size;
+
+                if (tracking)
+                    scanned[i] = {mtimeMillis(st), names[i], (uint64_t)st.st_size, method};
+            } });
+    }
+
+    for (auto &t : scanners)
+        t.join();
+
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+    {
+        uint64_t methodFiles = 0, methodBytes = 0;
+        for (size_t t = 0; t < count; t++)
+        {
+            methodFiles += found[(t * HTTP_METHOD_COUNT + m) * 2];
+            methodBytes += found[(t * HTTP_METHOD_COUNT + m) * 2 + 1];
+        }
+        files[m] = methodFiles;
+        bytes[m] = methodBytes;
+    }
+
+    if (!tracking)
+        return;
+
+    // Files that vanished during the scan were never counted
+    scanned.erase(remove_if(scanned.begin(), scanned.end(), [](const LogFileEntry &entry)
+                            { return entry.path.empty(); }),
+                  scanned.end());
+    sort(scanned.begin(), scanned.end(), [](const LogFileEntry &a, const LogFileEntry &b)
+         { return a.time < b.time; });
+
+    lock_guard<mutex> lock(mtx);
+    entries.assign(make_move_iterator(scanned.begin()), make_move_iterator(scanned.end()));
+}
+
+void LogAccounting::trackFiles()
+{
+    tracking = true;
+}
+
+void LogAccounting::add(const string &path, HttpMethod method, uint64_t size, int64_t time)
+{
+    files[(int)method].fetch_add(1, memory_order_relaxed);
+    bytes[(int)method].fetch_add(size, memory_order_relaxed);
+
+    if (tracking)
+    {
+        lock_guard<mutex> lock(mtx);
+        entries.push_back({time, path, size, method});
+    }
+}
+
+bool LogAccounting::popOldest(LogFileEntry &entry)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (entries.empty())
+            return false;
+
+        entry = move(entries.front());
+        entries.pop_front();
+    }
+
+    files[(int)entry.method].fetch_sub(1, memory_order_relaxed);
+    bytes[(int)entry.method].fetch_sub(entry.size, memory_order_relaxed);
+    return true;
+}
+
+int64_t LogAccounting::oldestTime()
+{
+    lock_guard<mutex> lock(mtx);
+    return entries.empty() ? 0 : entries.front().time;
+}
+
+uint64_t LogAccounting::fileCount()
+{
+    uint64_t total = 0;
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+        total += files[m].load(memory_order_relaxed);
+    return total;
+}
+
+uint64_t LogAccounting::byteCount()
+{
+    uint64_t total = 0;
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+        total += bytes[m].load(memory_order_relaxed);
+    return total;
+}
+
+uint64_t LogAccounting::fileCount(HttpMethod method)
+{
+    return files[(int)method].load(memory_order_relaxed);
+}
+
+uint64_t LogAccounting::byteCount(HttpMethod method)
+{
+    return bytes[(int)method].load(memory_order_relaxed);
+}
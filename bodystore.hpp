@@ -0,0 +1,519 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "files.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Hex SHA-256 digests are this long
+const size_t BODY_DIGEST_LENGTH = 64;
+
+// A blob's use is only queued for eviction again, and its mtime touched,
+// once the last one queued is older than this many milliseconds
+const int64_t BLOB_USE_GRANULARITY = 60000;
+
+// Temp files this old at startup, in milliseconds, were left by a crash
+const int64_t BLOB_TEMP_MAX_AGE = 3600000;
+
+// Incremental SHA-256 of a body
+class BodyHasher
+{
+private:
+    EVP_MD_CTX *ctx;
+
+public:
+    BodyHasher();
+    BodyHasher(const BodyHasher &) = delete;
+    ~BodyHasher();
+
+    void update(const char *data, size_t size);
+
+    // Hex digest of everything passed to update
+    string finish();
+};
+
+struct StoredBlob
+{
+    uint64_t size = 0;
+    // Last use in milliseconds since the epoch
+    int64_t used = 0;
+    // Time of its newest entry in the use queue
+    int64_t queued = 0;
+
+    // Data dumps that pointed at the blob
+    vector<string> links;
+};
+
+// Content-addressed store for body dumps under <logs>/data/blobs. Each
+// distinct body is written once, as blobs/<2 hex digits>/<62 hex digits>,
+// and .log files and data dumps refer to it by its SHA-256 digest.
+class BodyStore
+{
+private:
+    string dir;
+    atomic<uint64_t> temps{0};
+
+    // Blobs known to be on disk, so repeated bodies skip the stat
+    mutex mtx;
+    unordered_map<string, StoredBlob> blobs;
+    uint64_t bytes = 0;
+
+    // Blob uses, oldest first. An entry is stale once a newer one was
+    // queued for the blob or it was evicted.
+    deque<pair<int64_t, string>> uses;
+
+    bool isStored(const string &digest);
+    bool markStored(const string &digest, uint64_t size, int64_t used);
+    void touch(const string &digest);
+
+public:
+    BodyStore(string logsDir);
+    BodyStore(const BodyStore &) = delete;
+
+    static string blobPath(const string &logsDir, const string &digest);
+
+    // Stores `body` unless an identical one already is, and returns its
+    // digest, empty on failure
+    string put(const string &body);
+
+    // Where a streamed body is written before its digest is known
+    string tempPath();
+
+    // Moves a complete temp file to its blob, or drops it when the blob
+    // already exists
+    bool commit(const string &temp, const string &digest);
+
+    // Points the symlink `link` at a blob, replacing whatever was there
+    bool link(const string &link, const string &digest);
+
+    // Reads the body a digest refers to
+    static bool load(const string &logsDir, const string &digest, string &body);
+
+    // Learns the blobs and dump links already on disk, so they can be
+    // evicted, and removes temp files left by crashes
+    void scan();
+
+    // Least recently used blob, false if none is known
+    bool oldest(string &digest, int64_t &used);
+
+    // Removes a blob and the dumps still pointing at it, returning the
+    // bytes freed
+    uint64_t evict(const string &digest);
+
+    uint64_t storedBytes();
+};
+
+// A streamed body on its way into a store, hashed as it is written
+class BlobStream
+{
+private:
+    BodyStore *store;
+    string temp;
+    ofstream file;
+    BodyHasher hasher;
+    bool written = false;
+
+public:
+    BlobStream(BodyStore *s);
+    BlobStream(const BlobStream &) = delete;
+    ~BlobStream();
+
+    void write(const char *data, size_t size);
+
+    // Commits the body and returns its digest, empty if nothing was written
+    // or it failed
+    string finish();
+};
+
+BodyHasher::BodyHasher()
+{
+    ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+}
+
+BodyHasher::~BodyHasher()
+{
+    EVP_MD_CTX_free(ctx);
+}
+
+void BodyHasher::update(const char *data, size_t size)
+{
+    EVP_DigestUpdate(ctx, data, size);
+}
+
+string BodyHasher::finish()
+{
+    static const char *hex = "0123456789abcdef";
+
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (EVP_DigestFinal_ex(ctx, md, &length) != 1)
+        return "";
+
+    string digest(length * 2, '0');
+    for (unsigned int i = 0; i < length; i++)
+    {
+        digest[i * 2] = hex[md[i] >> 4];
+        digest[i * 2 + 1] = hex[md[i] & 15];
+    }
+    return digest;
+}
+
+BodyStore::BodyStore(string logsDir)
+{
+    dir = logsDir;
+}
+
+string BodyStore::blobPath(const string &logsDir, const string &digest)
+{
+    return logsDir + "/data/blobs/" + digest.substr(0, 2) + "/" + digest.substr(2);
+}
+
+// Counts as a use of the blob when it is there
+bool BodyStore::isStored(const string &digest)
+{
+    int64_t now = nowMillis();
+    bool stale = false;
+    {
+        lock_guard<mutex> lock(mtx);
+        auto it = blobs.find(digest);
+        if (it != blobs.end())
+        {
+            // Every use counts, so a blob never looks older than a log
+            // referring to it
+            it->second.used = max(it->second.used, now);
+            if (now - it->second.queued < BLOB_USE_GRANULARITY)
+                return true;
+
+            it->second.queued = now;
+            uses.emplace_back(now, digest);
+            stale = true;
+        }
+    }
+
+    if (stale)
+    {
+        touch(digest);
+        return true;
+    }
+
+    // Blobs from earlier runs count too
+    struct stat st;
+    if (::stat(blobPath(dir, digest).c_str(), &st) != 0)
+        return false;
+
+    if (markStored(digest, st.st_size, now))
+        touch(digest);
+    return true;
+}
+
+// False if the blob was known already
+bool BodyStore::markStored(const string &digest, uint64_t size, int64_t used)
+{
+    lock_guard<mutex> lock(mtx);
+    auto inserted = blobs.emplace(digest, StoredBlob());
+    if (!inserted.second)
+        return false;
+
+    inserted.first->second.size = size;
+    inserted.first->second.used = used;
+    inserted.first->second.queued = used;
+    bytes += size;
+    uses.emplace_back(used, digest);
+    return true;
+}
+
+// The mtime carries the last use over restarts
+void BodyStore::touch(const string &digest)
+{
+    ::utimensat(AT_FDCWD, blobPath(dir, digest).c_str(), nullptr, 0);
+}
+
+string BodyStore::put(const string &body)
+{
+    BodyHasher hasher;
+    hasher.update(body.data(), body.size());
+    string digest = hasher.finish();
+
+    if (digest.empty() || isStored(digest))
+        return digest;
+
+    string temp = tempPath();
+    {
+        ofstream file(temp, ios::binary);
+        file.write(body.data(), body.size());
+        if (!file)
+        {
+            ::unlink(temp.c_str());
+            return "";
+        }
+    }
+
+    return commit(temp, digest) ? digest : "";
+}
+
+string BodyStore::tempPath()
+{
+    string tempDir = dir + "/data/blobs/tmp";
+    filesystem::create_directories(tempDir);
+    return tempDir + "/" + to_string(getpid()) + "-" + to_string(temps++);
+}
+
+bool BodyStore::commit(const string &temp, const string &digest)
+{
+    if (isStored(digest))
+    {
+        ::unlink(temp.c_str());
+        return true;
+    }
+
+    // Writers racing on the same body rename identical files
+    string blob = blobPath(dir, digest);
+    filesystem::create_directories(filesystem::path(blob).parent_path());
+
+    struct stat st;
+    if (::stat(temp.c_str(), &st) != 0 || ::rename(temp.c_str(), blob.c_str()) != 0)
+    {
+        ::unlink(temp.c_str());
+        return false;
+    }
+
+    markStored(digest, st.st_size, nowMillis());
+    return true;
+}
+
+bool BodyStore::link(const string &link, const string &digest)
+{
+    filesystem::path linkPath(link);
+    string target = filesystem::path(blobPath(dir, digest)).lexically_relative(linkPath.parent_path()).string();
+
+    // Swapped in with a rename, so readers never see a missing dump
+    string temp = link + ".tmp" + to_string(temps++);
+    if (::symlink(target.c_str(), temp.c_str()) != 0)
+        return false;
+
+    if (::rename(temp.c_str(), link.c_str()) != 0)
+    {
+        ::unlink(temp.c_str());
+        return false;
+    }
+
+    lock_guard<mutex> lock(mtx);
+    auto it = blobs.find(digest);
+    if (it != blobs.end() && find(it->second.links.begin(), it->second.links.end(), link) == it->second.links.end())
+        it->second.links.push_back(link);
+    return true;
+}
+
+bool BodyStore::load(const string &logsDir, const string &digest, string &body)
+{
+    if (digest.size() != BODY_DIGEST_LENGTH)
+        return false;
+
+    ifstream file(blobPath(logsDir, digest), ios::binary);
+    if (!file)
+        return false;
+
+    body.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    return true;
+}
+
+void BodyStore::scan()
+{
+    string blobsDir = dir + "/data/blobs";
+    int64_t now = nowMillis();
+
+    vector<pair<pair<int64_t, string>, uint64_t>> found;
+    vector<pair<string, string>> links;
+    error_code ec;
+
+    for (auto it = filesystem::recursive_directory_iterator(blobsDir, ec); !ec && it != filesystem::recursive_directory_iterator(); it.increment(ec))
+    {
+        if (!it->is_regular_file(ec))
+            continue;
+
+        struct stat st;
+        string path = it->path().string();
+        if (::stat(path.c_str(), &st) != 0)
+            continue;
+
+        string parent = it->path().parent_path().filename().string();
+        if (parent == "tmp")
+        {
+            if (now - mtimeMillis(st) > BLOB_TEMP_MAX_AGE)
+                ::unlink(path.c_str());
+            continue;
+        }
+
+        string digest = parent + it->path().filename().string();
+        if (digest.size() != BODY_DIGEST_LENGTH)
+            continue;
+
+        // The mtime is only touched once per granularity, so the last use
+        // may be up to that much later
+        found.push_back({{mtimeMillis(st) + BLOB_USE_GRANULARITY, digest}, (uint64_t)st.st_size});
+    }
+
+    for (const char *kind : {"request", "response"})
+    {
+        ec.clear();
+        for (auto it = filesystem::recursive_directory_iterator(dir + "/data/" + kind, ec); !ec && it != filesystem::recursive_directory_iterator(); it.increment(ec))
+        {
+            if (!it->is_symlink(ec))
+                continue;
+
+            filesystem::path target = filesystem::read_symlink(it->path(), ec);
+            if (ec)
+                continue;
+
+            string digest = target.parent_path().filename().string() + target.filename().string();
+            if (digest.size() == BODY_DIGEST_LENGTH)
+                links.emplace_back(digest, it->path().string());
+        }
+    }
+
+    sort(found.begin(), found.end());
+
+    lock_guard<mutex> lock(mtx);
+
+    // Scanned blobs are older than any use since startup, so they go
+    // first; those a writer already found keep their newer use
+    vector<pair<int64_t, string>> scanned;
+    for (auto &blob : found)
+    {
+        auto inserted = blobs.emplace(blob.first.second, StoredBlob());
+        if (!inserted.second)
+            continue;
+
+        inserted.first->second.size = blob.second;
+        inserted.first->second.used = blob.first.first;
+        inserted.first->second.queued = blob.first.first;
+        bytes += blob.second;
+        scanned.push_back(blob.first);
+    }
+    uses.insert(uses.begin(), scanned.begin(), scanned.end());
+
+    for (auto &link : links)
+    {
+        auto it = blobs.find(link.first);
+        if (it != blobs.end() && find(it->second.links.begin(), it->second.links.end(), link.second) == it->second.links.end())
+            it->second.links.push_back(link.second);
+    }
+}
+
+bool BodyStore::oldest(string &digest, int64_t &used)
+{
+    lock_guard<mutex> lock(mtx);
+    while (!uses.empty())
+    {
+        auto it = blobs.find(uses.front().second);
+        if (it == blobs.end() || it->second.queued != uses.front().first)
+        {
+            uses.pop_front();
+            continue;
+        }
+
+        // Used since it was queued, so it goes back with its last use
+        if (it->second.used != it->second.queued)
+        {
+            it->second.queued = it->second.used;
+            uses.pop_front();
+            uses.emplace_back(it->second.used, it->first);
+            continue;
+        }
+
+        digest = it->first;
+        used = it->second.used;
+        return true;
+    }
+    return false;
+}
+
+uint64_t BodyStore::evict(const string &digest)
+{
+    StoredBlob blob;
+    {
+        lock_guard<mutex> lock(mtx);
+        auto it = blobs.find(digest);
+        if (it == blobs.end())
+            return 0;
+
+        blob = move(it->second);
+        blobs.erase(it);
+        bytes -= blob.size;
+    }
+
+    string path = blobPath(dir, digest);
+    ::unlink(path.c_str());
+
+    // Dumps since pointed at a newer body stay
+    for (const string &link : blob.links)
+    {
+        error_code ec;
+        filesystem::path target = filesystem::read_symlink(link, ec);
+        if (ec || target.filename() != digest.substr(2))
+            continue;
+
+        ::unlink(link.c_str());
+        ::rmdir(filesystem::path(link).parent_path().c_str());
+    }
+
+    return blob.size;
+}
+
+uint64_t BodyStore::storedBytes()
+{
+    lock_guard<mutex> lock(mtx);
+    return bytes;
+}
+
+BlobStream::BlobStream(BodyStore *s)
+{
+    store = s;
+    temp = store->tempPath();
+    file.open(temp, ios::binary);
+}
+
+BlobStream::~BlobStream()
+{
+    if (file.is_open())
+    {
+        file.close();
+        ::unlink(temp.c_str());
+    }
+}
+
+void BlobStream::write(const char *data, size_t size)
+{
+    file.write(data, size);
+    hasher.update(data, size);
+    written = written || size > 0;
+}
+
+string BlobStream::finish()
+{
+    file.close();
+
+    string digest = hasher.finish();
+    if (!written || !file || digest.empty() || !store->commit(temp, digest))
+    {
+        ::unlink(temp.c_str());
+        return "";
+    }
+    return digest;
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "files.hpp"
+#include "logduto.hpp"
+
+using namespace std;
+
+// Long-lived writer for logduto.log. Lines are appended to an in-memory
+// buffer under a lock, so they never interleave, and a flusher thread
+// writes the buffer through a persistent descriptor once it holds
+// `flushBytes` or every `flushInterval`, rotating the file past `rotateBytes`
+// and keeping the newest `rotateKeep` rotations.
+class CallLog
+{
+private:
+    string dir;
+    string filePath;
+    chrono::milliseconds flushInterval;
+    size_t flushBytes;
+    size_t rotateBytes;
+    size_t rotateKeep;
+
+    int fd = -1;
+    size_t fileSize = 0;
+
+    string buffer;
+    bool stopping = false;
+    mutex mtx;
+    condition_variable wakeup;
+    thread flusher;
+
+    void run();
+    void open();
+    void rotate();
+    void pruneRotated();
+    void writeOut(const string &data);
+
+public:
+    // A `keep` of 0 never removes rotations
+    CallLog(string d, int intervalMs, size_t bytes, size_t rotate, size_t keep);
+    CallLog(const CallLog &) = delete;
+    ~CallLog();
+
+    // Appends a whole line stamped with the current time
+    void write(string message);
+
+    // Flushes what is buffered, syncs it to disk and closes the file
+    void stop();
+};
+
+CallLog::CallLog(string d, int intervalMs, size_t bytes, size_t rotate, size_t keep)
+{
+    dir = d;
+    filePath = dir + "/logduto.log";
+    flushInterval = chrono::milliseconds(intervalMs > 0 ? intervalMs : 1);
+    flushBytes = bytes;
+    rotateBytes = rotate;
+    rotateKeep = keep;
+
+    open();
+
+    flusher = thread([this]
+                     { run(); });
+}
+
+CallLog::~CallLog()
+{
+    stop();
+}
+
+void CallLog::write(string message)
+{
+    string line = Logduto::formatCall(message, time(0));
+    bool full;
+
+    {
+        lock_guard<mutex> lock(mtx);
+        buffer += line;
+        full = buffer.size() >= flushBytes;
+    }
+
+    if (full)
+        wakeup.notify_one();
+}
+
+void CallLog::run()
+{
+    string pending;
+
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(mtx);
+            wakeup.wait_for(lock, flushInterval, [&]
+                            { return stopping || (!buffer.empty() && buffer.size() >= flushBytes); });
+
+            pending.swap(buffer);
+            if (pending.empty() && stopping)
+                break;
+        }
+
+        // Disk writes happen outside the lock so appenders never wait on them
+        if (!pending.empty())
+        {
+            writeOut(pending);
+            pending.clear();
+        }
+    }
+}
+
+void CallLog::open()
+{
+    try
+    {
+        filesystem::create_directories(dir);
+    }
+    catch (const exception &e)
+    {
+        cerr << e.what() << '\n';
+    }
+
+    fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        cerr << "Failed to open " << filePath << '\n';
+        return;
+    }
+
+    struct stat st;
+    fileSize = fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+void CallLog::rotate()
+{
+    ::close(fd);
+    fd = -1;
+
+    time_t now = time(0);
+    string rotated = dir + "/logduto_" + dateStr(now) + "_" + timeStr(now);
+    string target = rotated + ".log";
+
+    for (int i = 1; filesystem::exists(target); i++)
+        target = rotated + "_" + to_string(i) + ".log";
+
+    error_code ec;
+    filesystem::rename(filePath, target, ec);
+
+    open();
+    pruneRotated();
+}
+
+// Rotations are never written to again, so their mtime orders them
+void CallLog::pruneRotated()
+{
+    if (rotateKeep == 0)
+        return;
+
+    vector<pair<int64_t, string>> rotated;
+    error_code ec;
+    struct stat st;
+    for (auto &entry : filesystem::directory_iterator(dir, ec))
+    {
+        string name = entry.path().filename().string();
+        if (name.rfind("logduto_", 0) == 0 && entry.path().extension() == ".log" && ::stat(entry.path().c_str(), &st) == 0)
+            rotated.emplace_back(mtimeMillis(st), entry.path().string());
+    }
+
+    if (rotated.size() <= rotateKeep)
+        return;
+
+    sort(rotated.begin(), rotated.end());
+    for (size_t i = 0; i < rotated.size() - rotateKeep; i++)
+        ::unlink(rotated[i].second.c_str());
+}
+
+void CallLog::writeOut(const string &data)
+{
+    if (rotateBytes > 0 && fileSize > 0 && fileSize + data.size() > rotateBytes)
+        rotate();
+
+    if (fd < 0)
+        open();
+
+    if (fd < 0)
+        return;
+
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            cerr << "Failed to write " << filePath << '\n';
+            break;
+        }
+        written += n;
+    }
+
+    fileSize += written;
+}
+
+void CallLog::stop()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (stopping)
+            return;
+        stopping = true;
+    }
+
+    wakeup.notify_one();
+    flusher.join();
+
+    if (fd >= 0)
+    {
+        fsync(fd);
+        ::close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <strings.h>
+#include <zlib.h>
+
+using namespace std;
+
+// Responses smaller than this are sent as they are
+const size_t COMPRESS_MIN_BYTES = 1024;
+
+// Appends one gzip member holding `size` bytes of `data` to `out`
+bool gzipCompress(const char *data, size_t size, string &out, int level = Z_DEFAULT_COMPRESSION);
+
+// Inflates gzip data, several concatenated members included, into `out`
+bool gzipDecompress(const char *data, size_t size, string &out);
+
+// Whether the data starts with the gzip magic bytes
+bool isGzipped(const string &data);
+
+// Whether an Accept-Encoding value allows gzip, "gzip;q=0" does not
+bool acceptsGzip(const string &acceptEncoding);
+
+bool gzipCompress(const char *data, size_t size, string &out, int level)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    // 31 selects a gzip header instead of a zlib one
+    if (deflateInit2(&strm, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    size_t start = out.size();
+    out.resize(start + deflateBound(&strm, size));
+
+    strm.next_in = (Bytef *)data;
+    strm.avail_in = size;
+    strm.next_out = (Bytef *)&out[start];
+    strm.avail_out = out.size() - start;
+
+    int ret = deflate(&strm, Z_FINISH);
+    out.resize(start + strm.total_out);
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END)
+    {
+        out.resize(start);
+        return false;
+    }
+    return true;
+}
+
+bool gzipDecompress(const char *data, size_t size, string &out)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    // 47 accepts both gzip and zlib headers
+    if (inflateInit2(&strm, 47) != Z_OK)
+        return false;
+
+    strm.next_in = (Bytef *)data;
+    strm.avail_in = size;
+
+    char chunk[64 * 1024];
+    int ret = Z_OK;
+
+    while (true)
+    {
+        strm.next_out = (Bytef *)chunk;
+        strm.avail_out = sizeof(chunk);
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+        out.append(chunk, sizeof(chunk) - strm.avail_out);
+
+        if (ret == Z_STREAM_END && strm.avail_in > 0)
+        {
+            // Another member follows
+            inflateReset(&strm);
+            continue;
+        }
+        if (ret != Z_OK)
+            break;
+        if (strm.avail_in == 0 && strm.avail_out > 0)
+            break;
+    }
+
+    inflateEnd(&strm);
+    return ret == Z_STREAM_END;
+}
+
+bool isGzipped(const string &data)
+{
+    return data.size() >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b;
+}
+
+bool acceptsGzip(const string &acceptEncoding)
+{
+    size_t pos = 0;
+    while (pos < acceptEncoding.size())
+    {
+        size_t end = acceptEncoding.find(',', pos);
+        if (end == string::npos)
+            end = acceptEncoding.size();
+
+        while (pos < end && acceptEncoding[pos] == ' ')
+            pos++;
+
+        size_t params = acceptEncoding.find(';', pos);
+        size_t nameEnd = params < end ? params : end;
+        while (nameEnd > pos && acceptEncoding[nameEnd - 1] == ' ')
+            nameEnd--;
+
+        bool named = (nameEnd - pos == 4 && strncasecmp(acceptEncoding.data() + pos, "gzip", 4) == 0) ||
+                     (nameEnd - pos == 1 && acceptEncoding[pos] == '*');
+
+        if (named)
+        {
+            // Only an explicit zero weight refuses it
+            size_t q = params < end ? acceptEncoding.find("q=", params) : string::npos;
+            return q >= end || strtod(acceptEncoding.c_str() + q + 2, nullptr) > 0;
+        }
+
+        pos = end + 1;
+    }
+    return false;
+}
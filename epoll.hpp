@@ -0,0 +1,1447 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "libs/httplib.h"
+#include "headers.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Largest request or response head accepted
+const size_t EPOLL_HEAD_MAX = 64 * 1024;
+
+// Bytes buffered per direction before reading from the other side pauses
+const size_t EPOLL_BUFFER_BYTES = 256 * 1024;
+
+// Pipe size requested for splicing bodies between sockets
+const int EPOLL_PIPE_BYTES = 1024 * 1024;
+
+const int EPOLL_MAX_EVENTS = 256;
+const int EPOLL_TICK_MS = 1000;
+
+// Tracks where an HTTP/1.1 message body ends while its raw bytes are
+// forwarded untouched, optionally keeping the decoded payload
+class BodyFramer
+{
+public:
+    enum Kind
+    {
+        None,
+        Length,
+        Chunked,
+        UntilClose
+    };
+
+private:
+    enum State
+    {
+        Size,
+        Data,
+        DataEnd,
+        Trailer,
+        Done,
+        Failed
+    };
+
+    Kind kind = None;
+    State state = Done;
+    uint64_t remaining = 0;
+    uint64_t payloadBytes = 0;
+    string sizeLine;
+    size_t lineLength = 0;
+
+public:
+    void reset(Kind k, uint64_t length = 0);
+
+    // Consumes up to `size` bytes and returns how many belong to the body;
+    // the payload, without chunk framing, is appended to `payload` while it
+    // is shorter than `limit`
+    size_t feed(const char *data, size_t size, string *payload, size_t limit = SIZE_MAX);
+
+    // Payload bytes that may bypass feed(), 0 while chunk framing needs parsing
+    uint64_t passable() const;
+    void pass(uint64_t bytes);
+
+    // The peer closed, which ends an UntilClose body
+    void close();
+
+    // Payload bytes seen so far
+    uint64_t size() const;
+
+    Kind getKind() const;
+    bool done() const;
+    bool failed() const;
+};
+
+// Kernel pipe that body bytes are spliced through, from one socket to the
+// other, without being copied to userspace
+struct SplicePipe
+{
+    int fds[2] = {-1, -1};
+    size_t capacity = 0;
+    size_t bytes = 0;
+};
+
+// One request/response exchange as seen by the engine
+struct EpollExchange
+{
+    string method;
+    string target;
+    httplib::Headers reqHeaders;
+    string reqBody;
+    int status = -1;
+    string reason;
+    httplib::Headers resHeaders;
+    string resBody;
+    chrono::steady_clock::time_point started;
+    uint32_t latency = 0;
+    // Payload sizes, even past the part kept in reqBody and resBody
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    string error;
+};
+
+// Called on the event loop threads, so they should not block for long
+struct EpollHooks
+{
+    function<void(const EpollExchange &)> onRequest;
+    function<void(EpollExchange &)> onFinish;
+};
+
+bool parseHeaderLines(const string &head, size_t pos, httplib::Headers &headers);
+
+bool parseRequestHead(const string &head, string &method, string &target, string &version, httplib::Headers &headers);
+
+bool parseResponseHead(const string &head, int &status, string &reason, httplib::Headers &headers);
+
+// The methods httplib serves, so both engines take the same requests
+bool isServedMethod(const string &method);
+
+// How a request body is framed. False when the headers are ambiguous, so
+// the upstream could end the body elsewhere than the proxy: both
+// Transfer-Encoding and Content-Length, a Transfer-Encoding not ending in
+// chunked, or several or non-numeric Content-Length values.
+bool requestFraming(const httplib::Headers &headers, BodyFramer::Kind &kind, uint64_t &length);
+
+// Forwards plain HTTP/1.1 on a few event loop threads. Each loop owns a
+// SO_REUSEPORT listener and an epoll set holding its downstream
+// connections and their upstream connections, so a waiting request costs a
+// socket rather than a thread.
+class EpollEngine
+{
+private:
+    struct Conn;
+
+    enum EndpointKind
+    {
+        Listener,
+        Wakeup,
+        Downstream,
+        Upstream
+    };
+
+    struct Endpoint
+    {
+        EndpointKind kind;
+        Conn *conn;
+    };
+
+    struct Loop
+    {
+        int epfd = -1;
+        int listenFd = -1;
+        int wakeFd = -1;
+        Endpoint listener{Listener, nullptr};
+        Endpoint wakeup{Wakeup, nullptr};
+        unordered_map<Conn *, unique_ptr<Conn>> conns;
+        vector<pair<int, chrono::steady_clock::time_point>> idleUpstreams;
+        thread worker;
+    };
+
+    enum Phase
+    {
+        Idle,
+        Active,
+        Closing
+    };
+
+    struct Conn
+    {
+        Loop *loop;
+        int fd = -1;
+        int upFd = -1;
+        Endpoint down{Downstream, this};
+        Endpoint up{Upstream, this};
+        Phase phase = Idle;
+        bool closed = false;
+
+        bool downReadable = true, downWritable = true, downEof = false;
+        bool upReadable = false, upWritable = false, upConnected = false, upEof = false;
+
+        string in, toUp, upIn, toDown;
+
+        EpollExchange exchange;
+        BodyFramer reqFramer, resFramer;
+        SplicePipe reqPipe, resPipe;
+        bool keepAlive = false, upReusable = false, headSent = false;
+        chrono::steady_clock::time_point lastActivity;
+
+        explicit Conn(Loop *l) : loop(l) {}
+    };
+
+    struct sockaddr_storage upstreamAddr;
+    socklen_t upstreamAddrLen = 0;
+    string upstreamHost;
+
+    string host;
+    int port;
+    vector<unique_ptr<Loop>> loops;
+    chrono::seconds upstreamTimeout;
+    chrono::seconds keepAliveTimeout;
+    chrono::seconds poolIdle;
+    size_t poolSize;
+    size_t captureBytes;
+    EpollHooks hooks;
+
+    atomic<bool> running{false};
+    atomic<bool> stopping{false};
+
+    void runLoop(Loop &loop);
+    void accept(Loop &loop);
+    void pump(Conn &conn);
+    bool splicingRequest(Conn &conn);
+    bool splicingResponse(Conn &conn);
+    bool process(Conn &conn);
+    bool startExchange(Conn &conn, const string &version);
+    void finishExchange(Conn &conn);
+    void failExchange(Conn &conn, string error);
+    bool openUpstream(Conn &conn);
+    void releaseUpstream(Conn &conn, bool reusable);
+    void sweep(Loop &loop);
+    void closeConn(Conn &conn);
+    void closeIdle(Loop &loop);
+
+public:
+    // Bodies are kept for the hooks up to `capture` bytes; beyond that,
+    // plain Content-Length or until-close bodies are spliced without
+    // passing through userspace
+    EpollEngine(string url, string h, int p, int loopCount, int timeout, int keepAlive, int idle, size_t pool, size_t capture, EpollHooks hks);
+    EpollEngine(const EpollEngine &) = delete;
+    ~EpollEngine();
+
+    // Binds every loop's listener, false if the port cannot be used
+    bool listen();
+
+    // Serves until stop() and every open exchange finished
+    void run();
+    void stop();
+    bool isRunning();
+};
+
+void BodyFramer::reset(Kind k, uint64_t length)
+{
+    kind = k;
+    remaining = length;
+    payloadBytes = 0;
+    sizeLine.clear();
+    lineLength = 0;
+
+    if (kind == Chunked)
+        state = Size;
+    else if (kind == UntilClose || (kind == Length && length > 0))
+        state = Data;
+    else
+        state = Done;
+}
+
+size_t BodyFramer::feed(const char *data, size_t size, string *payload, size_t limit)
+{
+    auto keep = [&](const char *from, size_t n)
+    {
+        payloadBytes += n;
+        if (payload && payload->size() < limit)
+            payload->append(from, n < limit - payload->size() ? n : limit - payload->size());
+    };
+
+    if (kind == UntilClose)
+    {
+        if (state == Done)
+            return 0;
+        keep(data, size);
+        return size;
+    }
+
+    size_t i = 0;
+    while (i < size && state != Done && state != Failed)
+    {
+        switch (state)
+        {
+        case Size:
+        {
+            char c = data[i++];
+            if (c != '\n')
+            {
+                if (sizeLine.size() > 256)
+                    state = Failed;
+                sizeLine += c;
+                break;
+            }
+
+            char *end;
+            remaining = strtoull(sizeLine.c_str(), &end, 16);
+            if (end == sizeLine.c_str())
+            {
+                state = Failed;
+                break;
+            }
+
+            sizeLine.clear();
+            state = remaining > 0 ? Data : Trailer;
+            break;
+        }
+        case Data:
+        {
+            size_t n = size - i < remaining ? size - i : remaining;
+            keep(data + i, n);
+            i += n;
+            remaining -= n;
+
+            if (remaining == 0)
+                state = kind == Chunked ? DataEnd : Done;
+            break;
+        }
+        case DataEnd:
+        {
+            char c = data[i++];
+            if (c == '\n')
+                state = Size;
+            else if (c != '\r')
+                state = Failed;
+            break;
+        }
+        case Trailer:
+        {
+            char c = data[i++];
+            if (c == '\n')
+            {
+                if (lineLength == 0)
+                    state = Done;
+                lineLength = 0;
+            }
+            else if (c != '\r')
+            {
+                lineLength++;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    return i;
+}
+
+uint64_t BodyFramer::passable() const
+{
+    if (state != Data || kind == Chunked)
+        return 0;
+    return kind == UntilClose ? UINT64_MAX : remaining;
+}
+
+void BodyFramer::pass(uint64_t bytes)
+{
+    payloadBytes += bytes;
+
+    if (kind == Length)
+    {
+        remaining -= bytes;
+        if (remaining == 0)
+            state = Done;
+    }
+}
+
+void BodyFramer::close()
+{
+    if (kind == UntilClose)
+        state = Done;
+}
+
+uint64_t BodyFramer::size() const
+{
+    return payloadBytes;
+}
+
+BodyFramer::Kind BodyFramer::getKind() const
+{
+    return kind;
+}
+
+bool BodyFramer::done() const
+{
+    return state == Done;
+}
+
+bool BodyFramer::failed() const
+{
+    return state == Failed;
+}
+
+bool parseHeaderLines(const string &head, size_t pos, httplib::Headers &headers)
+{
+    while (pos < head.size())
+    {
+        size_t end = head.find("\r\n", pos);
+        if (end == string::npos || end == pos)
+            break;
+
+        size_t colon = head.find(':', pos);
+        if (colon == string::npos || colon > end || colon == pos || head[pos] == ' ' || head[pos] == '\t')
+            return false;
+
+        size_t valueStart = colon + 1;
+        while (valueStart < end && (head[valueStart] == ' ' || head[valueStart] == '\t'))
+            valueStart++;
+        size_t valueEnd = end;
+        while (valueEnd > valueStart && (head[valueEnd - 1] == ' ' || head[valueEnd - 1] == '\t'))
+            valueEnd--;
+
+        headers.emplace(head.substr(pos, colon - pos), head.substr(valueStart, valueEnd - valueStart));
+        pos = end + 2;
+    }
+
+    return true;
+}
+
+bool parseRequestHead(const string &head, string &method, string &target, string &version, httplib::Headers &headers)
+{
+    size_t lineEnd = head.find("\r\n");
+    size_t first = head.find(' ');
+    size_t second = first == string::npos ? string::npos : head.find(' ', first + 1);
+
+    if (lineEnd == string::npos || second == string::npos || second > lineEnd)
+        return false;
+
+    method = head.substr(0, first);
+    target = head.substr(first + 1, second - first - 1);
+    version = head.substr(second + 1, lineEnd - second - 1);
+
+    if (method.empty() || target.empty() || version.compare(0, 5, "HTTP/") != 0)
+        return false;
+
+    return parseHeaderLines(head, lineEnd + 2, headers);
+}
+
+bool isServedMethod(const string &method)
+{
+    static const char *methods[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH", "PRI"};
+
+    for (const char *served : methods)
+    {
+        if (method == served)
+            return true;
+    }
+    return false;
+}
+
+bool requestFraming(const httplib::Headers &headers, BodyFramer::Kind &kind, uint64_t &length)
+{
+    auto encodings = headers.equal_range("Transfer-Encoding");
+    auto lengths = headers.equal_range("Content-Length");
+    bool hasEncoding = encodings.first != encodings.second;
+    bool hasLength = lengths.first != lengths.second;
+
+    if (hasEncoding)
+    {
+        if (hasLength)
+            return false;
+
+        // Only the last coding frames the body
+        string last;
+        for (auto it = encodings.first; it != encodings.second; it++)
+        {
+            size_t comma = it->second.rfind(',');
+            last = it->second.substr(comma == string::npos ? 0 : comma + 1);
+        }
+
+        if (!headerListHas(last, "chunked", 7))
+            return false;
+
+        kind = BodyFramer::Chunked;
+        return true;
+    }
+
+    if (!hasLength)
+    {
+        kind = BodyFramer::None;
+        return true;
+    }
+
+    const string &value = lengths.first->second;
+    if (next(lengths.first) != lengths.second || value.empty() || value.size() > 19 ||
+        value.find_first_not_of("0123456789") != string::npos)
+        return false;
+
+    kind = BodyFramer::Length;
+    length = strtoull(value.c_str(), nullptr, 10);
+    return true;
+}
+
+bool parseResponseHead(const string &head, int &status, string &reason, httplib::Headers &headers)
+{
+    size_t lineEnd = head.find("\r\n");
+    if (lineEnd == string::npos || head.compare(0, 5, "HTTP/") != 0)
+        return false;
+
+    size_t first = head.find(' ');
+    if (first == string::npos || first + 4 > lineEnd)
+        return false;
+
+    status = atoi(head.c_str() + first + 1);
+    reason = first + 5 < lineEnd ? head.substr(first + 5, lineEnd - first - 5) : "";
+
+    if (status < 100 || status > 999)
+        return false;
+
+    return parseHeaderLines(head, lineEnd + 2, headers);
+}
+
+// Whether a comma separated header value lists `token`
+static bool headerHasToken(const httplib::Headers &headers, const char *name, const char *token)
+{
+    auto range = headers.equal_range(name);
+    for (auto it = range.first; it != range.second; it++)
+    {
+        if (headerListHas(it->second, token, strlen(token)))
+            return true;
+    }
+    return false;
+}
+
+// Appends the headers that may be forwarded, leaving out the hop-by-hop
+// ones and those the Connection header names. Framing headers stay, since
+// bodies pass through as they are.
+static void appendForwardHeaders(string &out, const httplib::Headers &headers, uint8_t skip)
+{
+    const string &connection = headerValue(headers, "Connection");
+
+    for (auto &header : headers)
+    {
+        if (!isForwardedHeader(header.first, skip, connection))
+            continue;
+
+        out += header.first;
+        out += ": ";
+        out += header.second;
+        out += "\r\n";
+    }
+}
+
+static void watchSocket(int epfd, int fd, void *endpoint)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = endpoint;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void setNoDelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Reads what is available into `buffer` without letting it pass `limit`.
+// Returns false once the peer closed or failed.
+static bool readInto(int fd, string &buffer, size_t limit, bool &readable)
+{
+    char chunk[64 * 1024];
+
+    while (readable && buffer.size() < limit)
+    {
+        size_t want = limit - buffer.size() < sizeof(chunk) ? limit - buffer.size() : sizeof(chunk);
+        ssize_t n = ::read(fd, chunk, want);
+
+        if (n > 0)
+        {
+            buffer.append(chunk, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            readable = false;
+            return true;
+        }
+
+        readable = false;
+        return false;
+    }
+
+    return true;
+}
+
+// Writes as much of `buffer` as the socket takes. Returns false on error.
+static bool writeFrom(int fd, string &buffer, bool &writable)
+{
+    size_t written = 0;
+
+    while (writable && written < buffer.size())
+    {
+        ssize_t n = ::send(fd, buffer.data() + written, buffer.size() - written, MSG_NOSIGNAL);
+
+        if (n > 0)
+        {
+            written += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            writable = false;
+            break;
+        }
+
+        buffer.erase(0, written);
+        return false;
+    }
+
+    buffer.erase(0, written);
+    return true;
+}
+
+static bool openPipe(SplicePipe &pipe)
+{
+    if (pipe.fds[0] >= 0)
+        return true;
+
+    if (pipe2(pipe.fds, O_NONBLOCK | O_CLOEXEC) != 0)
+        return false;
+
+    fcntl(pipe.fds[1], F_SETPIPE_SZ, EPOLL_PIPE_BYTES);
+    int capacity = fcntl(pipe.fds[1], F_GETPIPE_SZ);
+    pipe.capacity = capacity > 0 ? capacity : 65536;
+    pipe.bytes = 0;
+    return true;
+}
+
+static void closePipe(SplicePipe &pipe)
+{
+    if (pipe.fds[0] < 0)
+        return;
+
+    ::close(pipe.fds[0]);
+    ::close(pipe.fds[1]);
+    pipe.fds[0] = pipe.fds[1] = -1;
+    pipe.bytes = 0;
+}
+
+// Moves at most `limit` bytes from `from` into the pipe and as much of the
+// pipe as `to` takes. `taken` reports the bytes read from `from`. Returns
+// false once writing to `to` failed.
+static bool spliceThrough(SplicePipe &pipe, int from, int to, uint64_t limit, bool &readable, bool &eof, bool &writable, uint64_t &taken)
+{
+    taken = 0;
+
+    while (readable && !eof && taken < limit && pipe.bytes < pipe.capacity)
+    {
+        size_t want = pipe.capacity - pipe.bytes;
+        if (limit - taken < want)
+            want = limit - taken;
+
+        ssize_t n = splice(from, nullptr, pipe.fds[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            pipe.bytes += n;
+            taken += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            readable = false;
+            break;
+        }
+
+        readable = false;
+        eof = true;
+    }
+
+    while (writable && pipe.bytes > 0)
+    {
+        ssize_t n = splice(pipe.fds[0], nullptr, to, nullptr, pipe.bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            pipe.bytes -= n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            writable = false;
+            break;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+EpollEngine::EpollEngine(string url, string h, int p, int loopCount, int timeout, int keepAlive, int idle, size_t pool, size_t capture, EpollHooks hks)
+{
+    host = h;
+    port = p;
+    upstreamTimeout = chrono::seconds(timeout);
+    keepAliveTimeout = chrono::seconds(keepAlive);
+    poolIdle = chrono::seconds(idle);
+    poolSize = pool;
+    captureBytes = capture;
+    hooks = hks;
+
+    size_t schemeEnd = url.find("://");
+    if (schemeEnd == string::npos || url.compare(0, schemeEnd, "http") != 0)
+        throw runtime_error("The epoll engine only forwards to http:// upstreams\n");
+
+    string authority = url.substr(schemeEnd + 3);
+    authority = authority.substr(0, authority.find('/'));
+
+    string name = authority, service = "80";
+    size_t colon = authority.rfind(':');
+    if (colon != string::npos && authority.find(']', colon) == string::npos)
+    {
+        name = authority.substr(0, colon);
+        service = authority.substr(colon + 1);
+    }
+    if (name.size() > 1 && name.front() == '[' && name.back() == ']')
+        name = name.substr(1, name.size() - 2);
+
+    upstreamHost = authority;
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(name.c_str(), service.c_str(), &hints, &result) != 0 || !result)
+        throw runtime_error("Failed to resolve " + authority + "\n");
+
+    memcpy(&upstreamAddr, result->ai_addr, result->ai_addrlen);
+    upstreamAddrLen = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    for (int i = 0; i < (loopCount > 0 ? loopCount : 1); i++)
+        loops.push_back(make_unique<Loop>());
+}
+
+EpollEngine::~EpollEngine()
+{
+    for (auto &loop : loops)
+    {
+        if (loop->worker.joinable())
+            loop->worker.join();
+        for (auto &conn : loop->conns)
+            closeConn(*conn.second);
+        for (auto &idle : loop->idleUpstreams)
+            ::close(idle.first);
+        if (loop->listenFd >= 0)
+            ::close(loop->listenFd);
+        if (loop->wakeFd >= 0)
+            ::close(loop->wakeFd);
+        if (loop->epfd >= 0)
+            ::close(loop->epfd);
+    }
+}
+
+bool EpollEngine::listen()
+{
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) != 0 || !result)
+        return false;
+
+    bool ok = true;
+    for (auto &loop : loops)
+    {
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loop->listenFd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        int one = 1;
+        setsockopt(loop->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(loop->listenFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        if (loop->epfd < 0 || loop->wakeFd < 0 || loop->listenFd < 0 ||
+            bind(loop->listenFd, result->ai_addr, result->ai_addrlen) != 0 ||
+            ::listen(loop->listenFd, SOMAXCONN) != 0)
+        {
+            ok = false;
+            break;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->listener;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenFd, &ev);
+
+        ev.data.ptr = &loop->wakeup;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakeFd, &ev);
+    }
+
+    freeaddrinfo(result);
+    return ok;
+}
+
+void EpollEngine::run()
+{
+    running = true;
+
+    for (auto &loop : loops)
+    {
+        Loop *l = loop.get();
+        l->worker = thread([this, l]
+                           { runLoop(*l); });
+    }
+
+    for (auto &loop : loops)
+        loop->worker.join();
+
+    running = false;
+}
+
+void EpollEngine::stop()
+{
+    stopping = true;
+
+    uint64_t one = 1;
+    for (auto &loop : loops)
+    {
+        if (loop->wakeFd >= 0)
+            ::write(loop->wakeFd, &one, sizeof(one));
+    }
+}
+
+bool EpollEngine::isRunning()
+{
+    return running;
+}
+
+void EpollEngine::runLoop(Loop &loop)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    vector<Conn *> touched;
+    auto lastSweep = chrono::steady_clock::now();
+
+    while (!(stopping && loop.listenFd < 0 && loop.conns.empty()))
+    {
+        int count = epoll_wait(loop.epfd, events, EPOLL_MAX_EVENTS, EPOLL_TICK_MS);
+        touched.clear();
+
+        for (int i = 0; i < count; i++)
+        {
+            Endpoint *endpoint = (Endpoint *)events[i].data.ptr;
+
+            if (endpoint->kind == Listener)
+            {
+                accept(loop);
+                continue;
+            }
+
+            if (endpoint->kind == Wakeup)
+            {
+                uint64_t value;
+                ::read(loop.wakeFd, &value, sizeof(value));
+                continue;
+            }
+
+            Conn &conn = *endpoint->conn;
+            if (conn.closed)
+                continue;
+
+            bool readable = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+            bool writable = events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR);
+
+            if (endpoint->kind == Downstream)
+            {
+                conn.downReadable |= readable;
+                conn.downWritable |= writable;
+            }
+            else
+            {
+                conn.upReadable |= readable;
+                conn.upWritable |= writable;
+            }
+
+            touched.push_back(&conn);
+        }
+
+        for (Conn *conn : touched)
+        {
+            if (!conn->closed)
+                pump(*conn);
+        }
+
+        if (stopping)
+            closeIdle(loop);
+
+        if (chrono::steady_clock::now() - lastSweep >= chrono::milliseconds(EPOLL_TICK_MS))
+        {
+            sweep(loop);
+            lastSweep = chrono::steady_clock::now();
+        }
+
+        // Connections are only freed here, once no pending event can name them
+        for (auto it = loop.conns.begin(); it != loop.conns.end();)
+        {
+            if (it->second->closed)
+                it = loop.conns.erase(it);
+            else
+                it++;
+        }
+    }
+}
+
+void EpollEngine::accept(Loop &loop)
+{
+    while (true)
+    {
+        int fd = accept4(loop.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        if (stopping)
+        {
+            ::close(fd);
+            continue;
+        }
+
+        setNoDelay(fd);
+
+        auto conn = make_unique<Conn>(&loop);
+        conn->fd = fd;
+        conn->lastActivity = chrono::steady_clock::now();
+        watchSocket(loop.epfd, fd, &conn->down);
+
+        Conn *raw = conn.get();
+        loop.conns.emplace(raw, move(conn));
+        pump(*raw);
+    }
+}
+
+void EpollEngine::pump(Conn &conn)
+{
+    bool progress = true;
+
+    while (progress && !conn.closed)
+    {
+        progress = false;
+        size_t before;
+
+        // A connecting upstream reports completion as writable
+        if (conn.upFd >= 0 && !conn.upConnected && conn.upWritable)
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(conn.upFd, SOL_SOCKET, SO_ERROR, &error, &length);
+
+            if (error != 0)
+            {
+                failExchange(conn, "Error: " + httplib::to_string(httplib::Error::Connection));
+                progress = true;
+                continue;
+            }
+            conn.upConnected = true;
+        }
+
+        // Bytes headed for a pipe must not be read into the buffers
+        bool spliceIn = splicingRequest(conn);
+        bool spliceOut = splicingResponse(conn);
+
+        before = conn.in.size();
+        size_t inLimit = conn.phase == Idle ? EPOLL_HEAD_MAX + 1 : EPOLL_BUFFER_BYTES;
+        if (!conn.downEof && !spliceIn && !readInto(conn.fd, conn.in, inLimit, conn.downReadable))
+            conn.downEof = true;
+        progress |= conn.in.size() != before;
+
+        if (conn.upFd >= 0 && conn.upConnected && !conn.upEof && !spliceOut)
+        {
+            before = conn.upIn.size();
+            if (!readInto(conn.upFd, conn.upIn, EPOLL_BUFFER_BYTES, conn.upReadable))
+                conn.upEof = true;
+            progress |= conn.upIn.size() != before;
+        }
+
+        progress |= process(conn);
+        if (conn.closed)
+            break;
+
+        if (conn.upFd >= 0 && conn.upConnected && !conn.toUp.empty())
+        {
+            before = conn.toUp.size();
+            if (!writeFrom(conn.upFd, conn.toUp, conn.upWritable))
+                conn.upEof = true;
+            progress |= conn.toUp.size() != before;
+        }
+
+        if (splicingRequest(conn))
+        {
+            uint64_t taken;
+            before = conn.reqPipe.bytes;
+            if (!spliceThrough(conn.reqPipe, conn.fd, conn.upFd, conn.reqFramer.passable(), conn.downReadable, conn.downEof, conn.upWritable, taken))
+                conn.upEof = true;
+            conn.reqFramer.pass(taken);
+            progress |= taken > 0 || conn.reqPipe.bytes != before;
+        }
+
+        if (splicingResponse(conn))
+        {
+            uint64_t taken;
+            before = conn.resPipe.bytes;
+            bool written = spliceThrough(conn.resPipe, conn.upFd, conn.fd, conn.resFramer.passable(), conn.upReadable, conn.upEof, conn.downWritable, taken);
+            conn.resFramer.pass(taken);
+            progress |= taken > 0 || conn.resPipe.bytes != before;
+
+            if (!written)
+            {
+                conn.exchange.error = "Error: " + httplib::to_string(httplib::Error::Write);
+                finishExchange(conn);
+                closeConn(conn);
+                break;
+            }
+        }
+
+        if (!conn.toDown.empty())
+        {
+            before = conn.toDown.size();
+            if (!writeFrom(conn.fd, conn.toDown, conn.downWritable))
+            {
+                // The client is gone, nothing more can be delivered
+                if (conn.phase == Active)
+                {
+                    conn.exchange.error = "Error: " + httplib::to_string(httplib::Error::Write);
+                    finishExchange(conn);
+                    releaseUpstream(conn, false);
+                }
+                closeConn(conn);
+                break;
+            }
+            progress |= conn.toDown.size() != before;
+        }
+
+        if (progress)
+            conn.lastActivity = chrono::steady_clock::now();
+    }
+
+    if (!conn.closed && conn.phase == Closing && conn.toDown.empty())
+        closeConn(conn);
+}
+
+// Request body bytes go through the pipe once the captured part and every
+// buffered byte reached the upstream
+bool EpollEngine::splicingRequest(Conn &conn)
+{
+    if (conn.reqPipe.bytes > 0)
+        return true;
+
+    return conn.phase == Active && conn.upFd >= 0 && conn.upConnected && conn.in.empty() && conn.toUp.empty() &&
+           conn.reqFramer.passable() > 0 && conn.exchange.reqBody.size() >= captureBytes && openPipe(conn.reqPipe);
+}
+
+bool EpollEngine::splicingResponse(Conn &conn)
+{
+    if (conn.resPipe.bytes > 0)
+        return true;
+
+    return conn.phase == Active && conn.headSent && conn.upFd >= 0 && conn.upIn.empty() && conn.toDown.empty() &&
+           conn.resFramer.passable() > 0 && conn.exchange.resBody.size() >= captureBytes && openPipe(conn.resPipe);
+}
+
+bool EpollEngine::process(Conn &conn)
+{
+    bool changed = false;
+
+    if (conn.phase == Idle)
+    {
+        size_t end = conn.in.find("\r\n\r\n");
+        if (end == string::npos)
+        {
+            if (conn.in.size() > EPOLL_HEAD_MAX || conn.downEof || (stopping && conn.in.empty()))
+                closeConn(conn);
+            return false;
+        }
+
+        string head = conn.in.substr(0, end + 4);
+        conn.in.erase(0, end + 4);
+
+        string version;
+        conn.exchange = EpollExchange();
+        if (!parseRequestHead(head, conn.exchange.method, conn.exchange.target, version, conn.exchange.reqHeaders))
+        {
+            conn.toDown = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            conn.phase = Closing;
+            return true;
+        }
+
+        if (!isServedMethod(conn.exchange.method))
+        {
+            conn.toDown = "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            conn.phase = Closing;
+            return true;
+        }
+
+        if (!startExchange(conn, version))
+            return true;
+        changed = true;
+    }
+
+    if (conn.phase != Active)
+        return changed;
+
+    EpollExchange &ex = conn.exchange;
+
+    // Request body, raw bytes forwarded as they come
+    if (!conn.reqFramer.done() && !conn.in.empty() && conn.toUp.size() < EPOLL_BUFFER_BYTES)
+    {
+        size_t n = conn.reqFramer.feed(conn.in.data(), conn.in.size(), &ex.reqBody, captureBytes);
+
+        conn.toUp.append(conn.in, 0, n);
+        conn.in.erase(0, n);
+        changed |= n > 0;
+
+        if (conn.reqFramer.failed())
+        {
+            failExchange(conn, "Error: Invalid request body");
+            return true;
+        }
+    }
+
+    if (!conn.reqFramer.done() && conn.downEof)
+    {
+        failExchange(conn, "Error: " + httplib::to_string(httplib::Error::Canceled));
+        return true;
+    }
+
+    // Response head, interim 1xx responses are passed through as they are
+    while (!conn.headSent)
+    {
+        size_t end = conn.upIn.find("\r\n\r\n");
+        if (end == string::npos)
+        {
+            if (conn.upIn.size() > EPOLL_HEAD_MAX || conn.upEof)
+            {
+                failExchange(conn, "Error: " + httplib::to_string(httplib::Error::Read));
+                return true;
+            }
+            break;
+        }
+
+        int status;
+        string reason;
+        httplib::Headers headers;
+        if (!parseResponseHead(conn.upIn.substr(0, end + 4), status, reason, headers))
+        {
+            failExchange(conn, "Error: " + httplib::to_string(httplib::Error::Read));
+            return true;
+        }
+
+        if (status < 200 && status != 101)
+        {
+            conn.toDown.append(conn.upIn, 0, end + 4);
+            conn.upIn.erase(0, end + 4);
+            changed = true;
+            continue;
+        }
+
+        conn.upIn.erase(0, end + 4);
+        ex.status = status;
+        ex.reason = reason;
+        ex.resHeaders = move(headers);
+        ex.latency = elapsedMicros(ex.started);
+
+        bool noBody = ex.method == "HEAD" || status == 204 || status == 304;
+        if (noBody)
+            conn.resFramer.reset(BodyFramer::None);
+        else if (headerHasToken(ex.resHeaders, "Transfer-Encoding", "chunked"))
+            conn.resFramer.reset(BodyFramer::Chunked);
+        else if (ex.resHeaders.count("Content-Length"))
+            conn.resFramer.reset(BodyFramer::Length, strtoull(ex.resHeaders.find("Content-Length")->second.c_str(), nullptr, 10));
+        else
+            conn.resFramer.reset(BodyFramer::UntilClose);
+
+        conn.upReusable = !headerHasToken(ex.resHeaders, "Connection", "close");
+        if (conn.resFramer.getKind() == BodyFramer::UntilClose)
+            conn.keepAlive = false;
+
+        conn.toDown += "HTTP/1.1 " + to_string(status) + " " + reason + "\r\n";
+        appendForwardHeaders(conn.toDown, ex.resHeaders, HEADER_HOP);
+        conn.toDown += conn.keepAlive && !stopping ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        conn.headSent = true;
+        changed = true;
+    }
+
+    if (!conn.headSent)
+        return changed;
+
+    // Response body
+    if (!conn.resFramer.done() && !conn.upIn.empty() && conn.toDown.size() < EPOLL_BUFFER_BYTES)
+    {
+        size_t n = conn.resFramer.feed(conn.upIn.data(), conn.upIn.size(), &ex.resBody, captureBytes);
+
+        conn.toDown.append(conn.upIn, 0, n);
+        conn.upIn.erase(0, n);
+        changed |= n > 0;
+    }
+
+    if (conn.upEof && conn.upIn.empty())
+        conn.resFramer.close();
+
+    if (conn.resFramer.failed() || (!conn.resFramer.done() && conn.upEof && conn.upIn.empty()))
+    {
+        failExchange(conn, "Error: " + httplib::to_string(httplib::Error::Read));
+        return true;
+    }
+
+    if (conn.resFramer.done() && conn.reqFramer.done() && conn.reqPipe.bytes == 0 && conn.resPipe.bytes == 0)
+    {
+        bool reusable = conn.upReusable && !conn.upEof && conn.upIn.empty() && conn.toUp.empty();
+        finishExchange(conn);
+        releaseUpstream(conn, reusable);
+        conn.phase = conn.keepAlive && !stopping ? Idle : Closing;
+        changed = true;
+    }
+
+    return changed;
+}
+
+bool EpollEngine::startExchange(Conn &conn, const string &version)
+{
+    EpollExchange &ex = conn.exchange;
+    ex.started = chrono::steady_clock::now();
+
+    BodyFramer::Kind framing;
+    uint64_t length = 0;
+    if (!requestFraming(ex.reqHeaders, framing, length))
+    {
+        conn.toDown = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        conn.phase = Closing;
+        return false;
+    }
+
+    if (version == "HTTP/1.0")
+        conn.keepAlive = headerHasToken(ex.reqHeaders, "Connection", "keep-alive");
+    else
+        conn.keepAlive = !headerHasToken(ex.reqHeaders, "Connection", "close");
+
+    conn.reqFramer.reset(framing, length);
+
+    conn.headSent = false;
+    conn.upReusable = false;
+    conn.phase = Active;
+
+    if (hooks.onRequest)
+        hooks.onRequest(ex);
+
+    conn.toUp = ex.method + " " + ex.target + " HTTP/1.1\r\nHost: " + upstreamHost + "\r\n";
+    appendForwardHeaders(conn.toUp, ex.reqHeaders, HEADER_HOP | HEADER_LOCAL);
+    conn.toUp += "Connection: keep-alive\r\n\r\n";
+
+    if (!openUpstream(conn))
+    {
+        failExchange(conn, "Error: " + httplib::to_string(httplib::Error::Connection));
+        return false;
+    }
+
+    return true;
+}
+
+void EpollEngine::finishExchange(Conn &conn)
+{
+    conn.exchange.bytesIn = conn.reqFramer.size();
+    conn.exchange.bytesOut = conn.resFramer.size();
+
+    if (hooks.onFinish)
+        hooks.onFinish(conn.exchange);
+}
+
+// Reports the error and answers 599 like the buffered engine when nothing
+// was sent yet, otherwise cuts the response short
+void EpollEngine::failExchange(Conn &conn, string error)
+{
+    conn.exchange.error = error;
+    finishExchange(conn);
+    releaseUpstream(conn, false);
+    closePipe(conn.reqPipe);
+    closePipe(conn.resPipe);
+
+    if (!conn.headSent)
+    {
+        string body = "--- Error ---";
+        conn.toDown = "HTTP/1.1 599 Error\r\nContent-Type: text/plain\r\nContent-Length: " + to_string(body.size()) +
+                      "\r\nConnection: close\r\n\r\n" + body;
+    }
+
+    conn.phase = Closing;
+}
+
+bool EpollEngine::openUpstream(Conn &conn)
+{
+    Loop &loop = *conn.loop;
+    auto now = chrono::steady_clock::now();
+
+    // Most recently used first; anything expired, closed or readable is stale
+    while (!loop.idleUpstreams.empty())
+    {
+        auto idle = loop.idleUpstreams.back();
+        loop.idleUpstreams.pop_back();
+
+        char probe;
+        ssize_t n = recv(idle.first, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        bool alive = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+        if (alive && now - idle.second < poolIdle)
+        {
+            conn.upFd = idle.first;
+            conn.upConnected = true;
+            conn.upReadable = false;
+            conn.upWritable = true;
+            conn.upEof = false;
+            watchSocket(loop.epfd, conn.upFd, &conn.up);
+            return true;
+        }
+
+        ::close(idle.first);
+    }
+
+    int fd = socket(upstreamAddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    if (connect(fd, (struct sockaddr *)&upstreamAddr, upstreamAddrLen) != 0 && errno != EINPROGRESS)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    setNoDelay(fd);
+
+    conn.upFd = fd;
+    conn.upConnected = false;
+    conn.upReadable = false;
+    conn.upWritable = false;
+    conn.upEof = false;
+    watchSocket(loop.epfd, fd, &conn.up);
+    return true;
+}
+
+void EpollEngine::releaseUpstream(Conn &conn, bool reusable)
+{
+    if (conn.upFd < 0)
+        return;
+
+    Loop &loop = *conn.loop;
+    epoll_ctl(loop.epfd, EPOLL_CTL_DEL, conn.upFd, nullptr);
+
+    if (reusable && !stopping && loop.idleUpstreams.size() < poolSize)
+        loop.idleUpstreams.emplace_back(conn.upFd, chrono::steady_clock::now());
+    else
+        ::close(conn.upFd);
+
+    conn.upFd = -1;
+    conn.upConnected = false;
+    conn.upIn.clear();
+    conn.toUp.clear();
+}
+
+void EpollEngine::sweep(Loop &loop)
+{
+    auto now = chrono::steady_clock::now();
+
+    for (auto &entry : loop.conns)
+    {
+        Conn &conn = *entry.second;
+        if (conn.closed)
+            continue;
+
+        auto idle = now - conn.lastActivity;
+
+        if (conn.phase == Idle && idle > keepAliveTimeout)
+            closeConn(conn);
+        else if (conn.phase == Active && idle > upstreamTimeout)
+        {
+            failExchange(conn, "Error: " + httplib::to_string(httplib::Error::Read));
+            pump(conn);
+        }
+        else if (conn.phase == Closing && idle > upstreamTimeout)
+            closeConn(conn);
+    }
+
+    while (!loop.idleUpstreams.empty() && now - loop.idleUpstreams.front().second > poolIdle)
+    {
+        ::close(loop.idleUpstreams.front().first);
+        loop.idleUpstreams.erase(loop.idleUpstreams.begin());
+    }
+}
+
+void EpollEngine::closeConn(Conn &conn)
+{
+    if (conn.closed)
+        return;
+
+    releaseUpstream(conn, false);
+    closePipe(conn.reqPipe);
+    closePipe(conn.resPipe);
+    epoll_ctl(conn.loop->epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    ::close(conn.fd);
+    conn.closed = true;
+}
+
+// Once stopping, the listener goes away and connections between requests
+// are closed; active exchanges finish first
+void EpollEngine::closeIdle(Loop &loop)
+{
+    if (loop.listenFd >= 0)
+    {
+        epoll_ctl(loop.epfd, EPOLL_CTL_DEL, loop.listenFd, nullptr);
+        ::close(loop.listenFd);
+        loop.listenFd = -1;
+    }
+
+    for (auto &entry : loop.conns)
+    {
+        Conn &conn = *entry.second;
+        if (!conn.closed && conn.phase == Idle && conn.in.empty())
+            closeConn(conn);
+    }
+
+    for (auto &idle : loop.idleUpstreams)
+        ::close(idle.first);
+    loop.idleUpstreams.clear();
+}
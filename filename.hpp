@@ -0,0 +1,205 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+// Longest slice of the request path kept in a file name, leaving room for
+// the method, timestamp, suffix and extension within NAME_MAX
+const size_t MAX_NAME_PATH_LENGTH = 160;
+
+atomic<uint64_t> logFileSuffix{0};
+
+// Characters that cannot or should not appear in a file name
+bool isUnsafeNameChar(char c)
+{
+    switch (c)
+    {
+    case '/':
+    case '\\':
+    case '<':
+    case '>':
+    case '"':
+    case '|':
+    case '*':
+        return true;
+    default:
+        return (unsigned char)c < 0x20 || c == 0x7f;
+    }
+}
+
+// Appends a request method as a single file name component: unsafe
+// characters become '_', and so does a method made only of dots
+void appendMethodName(string &out, const string &method)
+{
+    bool dots = method.find_first_not_of('.') == string::npos;
+    for (char c : method)
+        out += dots || isUnsafeNameChar(c) ? '_' : c;
+}
+
+void appendTwoDigits(string &out, int value)
+{
+    out += (char)('0' + value / 10 % 10);
+    out += (char)('0' + value % 10);
+}
+
+// Appends YYYY-MM-DD_HH:MM:SS in local time
+void appendDateTime(string &out, time_t when)
+{
+    tm local;
+    localtime_r(&when, &local);
+
+    int year = local.tm_year + 1900;
+    appendTwoDigits(out, year / 100);
+    appendTwoDigits(out, year % 100);
+    out += '-';
+    appendTwoDigits(out, local.tm_mon + 1);
+    out += '-';
+    appendTwoDigits(out, local.tm_mday);
+    out += '_';
+    appendTwoDigits(out, local.tm_hour);
+    out += ':';
+    appendTwoDigits(out, local.tm_min);
+    out += ':';
+    appendTwoDigits(out, local.tm_sec);
+}
+
+// How per-request log files are spread under the logs directory, so no
+// single directory grows to millions of entries
+enum class LogLayout
+{
+    Flat,
+    // YYYY/MM/DD/HH/ in local time
+    Hour,
+    // 256 directories, 00/ to ff/, picked by a hash of the name
+    Hash
+};
+
+LogLayout logLayoutFromString(string layout)
+{
+    if (layout == "flat")
+        return LogLayout::Flat;
+    if (layout == "hour")
+        return LogLayout::Hour;
+    if (layout == "hash")
+        return LogLayout::Hash;
+    throw runtime_error("Unknown log layout: " + layout + "\n");
+}
+
+// Appends the directory a log file goes to under the logs directory,
+// with its trailing '/', nothing for the flat layout
+void appendLogShard(string &out, LogLayout layout, const string &method, const string &path, time_t when)
+{
+    if (layout == LogLayout::Hour)
+    {
+        tm local;
+        localtime_r(&when, &local);
+
+        int year = local.tm_year + 1900;
+        appendTwoDigits(out, year / 100);
+        appendTwoDigits(out, year % 100);
+        out += '/';
+        appendTwoDigits(out, local.tm_mon + 1);
+        out += '/';
+        appendTwoDigits(out, local.tm_mday);
+        out += '/';
+        appendTwoDigits(out, local.tm_hour);
+        out += '/';
+    }
+    else if (layout == LogLayout::Hash)
+    {
+        // FNV-1a; files that only differ by suffix share a shard, so the
+        // suffix search stays within one directory
+        uint64_t hash = 14695981039346656037ULL;
+        for (char c : method)
+            hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+        for (char c : path)
+            hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+        hash = (hash ^ (uint64_t)when) * 1099511628211ULL;
+
+        static const char *hex = "0123456789abcdef";
+        uint8_t shard = hash ^ (hash >> 32);
+        out += hex[shard >> 4];
+        out += hex[shard & 15];
+        out += '/';
+    }
+}
+
+// Whether a directory named `name`, `depth` levels below the logs
+// directory, is one appendLogShard makes for `layout`
+bool isLogShard(const string &name, int depth, LogLayout layout)
+{
+    auto isDigits = [&](size_t length, const char *chars)
+    {
+        return name.size() == length && name.find_first_not_of(chars) == string::npos;
+    };
+
+    if (layout == LogLayout::Hour)
+        return depth == 0 ? isDigits(4, "0123456789") : depth <= 3 && isDigits(2, "0123456789");
+    if (layout == LogLayout::Hash)
+        return depth == 0 && isDigits(2, "0123456789abcdef");
+    return false;
+}
+
+// Builds DIR/[SHARD/]METHOD_path_YYYY-MM-DD_HH:MM:SS[_SUFFIX]EXTENSION into
+// `out` with a single allocation. Path separators and unsafe characters
+// become '_', in the method too, and the path is cut at
+// MAX_NAME_PATH_LENGTH bytes.
+void buildLogFileName(string &out, const string &dir, LogLayout layout, const string &method, const string &path,
+                      time_t when, uint64_t suffix, const char *extension)
+{
+    size_t pathLength = path.size() < MAX_NAME_PATH_LENGTH ? path.size() : MAX_NAME_PATH_LENGTH;
+
+    out.clear();
+    out.reserve(dir.size() + method.size() + pathLength + 80);
+
+    out += dir;
+    out += '/';
+    appendLogShard(out, layout, method, path, when);
+    appendMethodName(out, method);
+
+    for (size_t i = 0; i < pathLength; i++)
+        out += isUnsafeNameChar(path[i]) ? '_' : path[i];
+
+    out += '_';
+    appendDateTime(out, when);
+
+    if (suffix > 0)
+    {
+        char digits[24];
+        int length = snprintf(digits, sizeof(digits), "_%llu", (unsigned long long)suffix);
+        out.append(digits, length);
+    }
+
+    out += extension;
+}
+
+// Unique suffix for a name that is already taken
+uint64_t nextLogFileSuffix()
+{
+    return ++logFileSuffix;
+}
+
+// ctime() output without its trailing newline and day padding,
+// e.g. "Sat Oct 7 11:48:03 2026"
+string readableDate(time_t when)
+{
+    char buf[26];
+    ctime_r(&when, buf);
+
+    string date;
+    date.reserve(sizeof(buf));
+
+    for (char *c = buf; *c && *c != '\n'; c++)
+    {
+        if (*c == ' ' && c[1] == ' ')
+            continue;
+        date += *c;
+    }
+
+    return date;
+}
@@ -1,16 +1,81 @@
+#pragma once
+
+#include <cstdint>
 #include <filesystem>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "filename.hpp"
 
 using namespace std;
 
-bool cleanLogFiles(string directory)
+// A per-request log, plain .log or compressed .log.gz
+bool isLogFile(const filesystem::path &path)
 {
-    try
+    string ext = path.extension().string();
+    return ext == ".log" || (ext == ".gz" && path.stem().extension() == ".log");
+}
+
+// The call log, logduto.log, and its rotations
+bool isCallLogFile(const filesystem::path &path)
+{
+    return path.filename().string().rfind("logduto", 0) == 0;
+}
+
+// Calls `fn` with each per-request or call log under `directory`, in the
+// shard directories of `layout` too, which are collected into `dirs`. Other
+// directories, data and segments among them, are left alone.
+template <typename Fn>
+void forEachLogFile(const string &directory, LogLayout layout, Fn fn, vector<filesystem::path> *dirs = nullptr)
+{
+    error_code ec;
+    for (auto it = filesystem::recursive_directory_iterator(directory, ec); !ec && it != filesystem::recursive_directory_iterator(); it.increment(ec))
     {
-        for (const auto &entry : filesystem::directory_iterator(directory))
+        if (it->is_directory(ec))
         {
-            if (entry.is_regular_file() && entry.path().extension() == ".log")
-                filesystem::remove(entry.path());
+            if (!isLogShard(it->path().filename().string(), it.depth(), layout))
+                it.disable_recursion_pending();
+            else if (dirs)
+                dirs->push_back(it->path());
+            continue;
         }
+
+        if (it->is_regular_file(ec) && isLogFile(it->path()))
+            fn(it->path());
+    }
+}
+
+// Removes `path` and then its parents while they are empty, up to but not
+// including `top`
+void removeEmptyDirs(filesystem::path path, const filesystem::path &top)
+{
+    while (!path.empty() && path != top && path.native().size() > top.native().size())
+    {
+        if (::rmdir(path.c_str()) != 0)
+            break;
+        path = path.parent_path();
+    }
+}
+
+int64_t mtimeMillis(const struct stat &st)
+{
+    return (int64_t)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+}
+
+bool cleanLogFiles(string directory, LogLayout layout)
+{
+    try
+    {
+        vector<filesystem::path> shards;
+        forEachLogFile(directory, layout, [](const filesystem::path &path)
+                       { filesystem::remove(path); }, &shards);
+
+        // Deepest first, so emptied parents go as well
+        for (auto it = shards.rbegin(); it != shards.rend(); it++)
+            ::rmdir(it->c_str());
+
+        filesystem::remove_all(directory + "/segments");
         return true;
     }
     catch (const exception &e)
@@ -18,3 +83,16 @@ bool cleanLogFiles(string directory)
         return false;
     }
 }
+
+// Per-request files are closed without fsync, so sync the whole filesystem
+// holding the logs once instead
+bool syncLogFiles(string directory)
+{
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    bool synced = syncfs(fd) == 0;
+    ::close(fd);
+    return synced;
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <strings.h>
+#include "libs/httplib.h"
+
+using namespace std;
+
+// Describes one connection and is never forwarded
+const uint8_t HEADER_HOP = 1;
+
+// Body framing, recomputed by whoever decodes and re-sends the body
+const uint8_t HEADER_FRAMING = 2;
+
+// Added for this hop by the client or by httplib, neither forwarded nor
+// logged with the request
+const uint8_t HEADER_LOCAL = 4;
+
+// Flags of a header name, 0 for ordinary headers. One hash and at most
+// one comparison.
+uint8_t headerFlags(const string &name);
+
+// Whether a comma separated list such as a Connection value names `token`
+bool headerListHas(const string &list, const char *token, size_t length);
+
+// Value of the first `name` header, empty if there is none
+const string &headerValue(const httplib::Headers &headers, const char *name);
+
+// Whether `name` passes on when headers flagged in `skip`, and those the
+// request's `connection` value lists, are left out
+bool isForwardedHeader(const string &name, uint8_t skip, const string &connection);
+
+// Serializes headers for the logs as "Name: value" lines, without a
+// trailing newline
+void appendHeaderLines(string &out, const httplib::Headers &headers, uint8_t skip);
+
+struct HeaderSlot
+{
+    const char *name = nullptr;
+    size_t length = 0;
+    uint8_t flags = 0;
+};
+
+const size_t HEADER_TABLE_SIZE = 32;
+
+constexpr char asciiLower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+constexpr size_t constLength(const char *str)
+{
+    size_t length = 0;
+    while (str[length])
+        length++;
+    return length;
+}
+
+// Length, first and last character tell every listed name apart
+constexpr size_t headerHash(size_t length, char first, char last)
+{
+    return (length + asciiLower(first) * 14 + asciiLower(last)) & (HEADER_TABLE_SIZE - 1);
+}
+
+constexpr HeaderSlot HEADER_NAMES[] = {
+    {"Host", constLength("Host"), HEADER_LOCAL},
+    {"LOCAL_ADDR", constLength("LOCAL_ADDR"), HEADER_LOCAL},
+    {"LOCAL_PORT", constLength("LOCAL_PORT"), HEADER_LOCAL},
+    {"REMOTE_ADDR", constLength("REMOTE_ADDR"), HEADER_LOCAL},
+    {"REMOTE_PORT", constLength("REMOTE_PORT"), HEADER_LOCAL},
+    {"Connection", constLength("Connection"), HEADER_HOP},
+    {"Keep-Alive", constLength("Keep-Alive"), HEADER_HOP},
+    {"Proxy-Connection", constLength("Proxy-Connection"), HEADER_HOP},
+    {"Proxy-Authenticate", constLength("Proxy-Authenticate"), HEADER_HOP},
+    {"Proxy-Authorization", constLength("Proxy-Authorization"), HEADER_HOP},
+    {"TE", constLength("TE"), HEADER_HOP},
+    {"Trailer", constLength("Trailer"), HEADER_HOP},
+    {"Upgrade", constLength("Upgrade"), HEADER_HOP},
+    {"Transfer-Encoding", constLength("Transfer-Encoding"), HEADER_FRAMING},
+    {"Content-Length", constLength("Content-Length"), HEADER_FRAMING}};
+
+struct HeaderTable
+{
+    HeaderSlot slots[HEADER_TABLE_SIZE];
+    size_t used = 0;
+};
+
+constexpr HeaderTable buildHeaderTable()
+{
+    HeaderTable table{};
+    for (const HeaderSlot &entry : HEADER_NAMES)
+    {
+        HeaderSlot &slot = table.slots[headerHash(entry.length, entry.name[0], entry.name[entry.length - 1])];
+        if (!slot.name)
+            table.used++;
+        slot = entry;
+    }
+    return table;
+}
+
+constexpr HeaderTable HEADER_TABLE = buildHeaderTable();
+
+static_assert(HEADER_TABLE.used == sizeof(HEADER_NAMES) / sizeof(HEADER_NAMES[0]),
+              "header names collide, adjust headerHash");
+
+uint8_t headerFlags(const string &name)
+{
+    if (name.empty())
+        return 0;
+
+    const HeaderSlot &slot = HEADER_TABLE.slots[headerHash(name.size(), name.front(), name.back())];
+    if (!slot.name || slot.length != name.size() || strncasecmp(slot.name, name.data(), slot.length) != 0)
+        return 0;
+
+    return slot.flags;
+}
+
+bool headerListHas(const string &list, const char *token, size_t length)
+{
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t end = list.find(',', pos);
+        if (end == string::npos)
+            end = list.size();
+
+        size_t start = pos;
+        while (start < end && (list[start] == ' ' || list[start] == '\t'))
+            start++;
+        size_t stop = end;
+        while (stop > start && (list[stop - 1] == ' ' || list[stop - 1] == '\t'))
+            stop--;
+
+        if (stop - start == length && strncasecmp(list.data() + start, token, length) == 0)
+            return true;
+
+        pos = end + 1;
+    }
+    return false;
+}
+
+const string &headerValue(const httplib::Headers &headers, const char *name)
+{
+    static const string emptyStr;
+
+    auto it = headers.find(name);
+    return it == headers.end() ? emptyStr : it->second;
+}
+
+bool isForwardedHeader(const string &name, uint8_t skip, const string &connection)
+{
+    if (headerFlags(name) & skip)
+        return false;
+
+    return connection.empty() || !headerListHas(connection, name.data(), name.size());
+}
+
+void appendHeaderLines(string &out, const httplib::Headers &headers, uint8_t skip)
+{
+    for (auto &header : headers)
+    {
+        if (headerFlags(header.first) & skip)
+            continue;
+
+        if (!out.empty())
+            out += '\n';
+        out += header.first;
+        out += ": ";
+        out += header.second;
+    }
+}
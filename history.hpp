@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+
+using namespace std;
+
+// Fixed-capacity circular buffer: pushing into a full history overwrites
+// the oldest entry in O(1). Entries are indexed from oldest (0) to newest.
+template <typename T>
+class RingHistory
+{
+private:
+    vector<T> entries;
+    size_t head = 0;
+    size_t count = 0;
+
+public:
+    explicit RingHistory(size_t capacity);
+
+    void push(T entry);
+
+    const T &at(size_t index) const;
+    size_t size() const;
+    size_t capacity() const;
+};
+
+template <typename T>
+RingHistory<T>::RingHistory(size_t capacity)
+{
+    entries.resize(capacity > 0 ? capacity : 1);
+}
+
+template <typename T>
+void RingHistory<T>::push(T entry)
+{
+    entries[(head + count) % entries.size()] = move(entry);
+
+    if (count < entries.size())
+        count++;
+    else
+        head = (head + 1) % entries.size();
+}
+
+template <typename T>
+const T &RingHistory<T>::at(size_t index) const
+{
+    return entries[(head + index) % entries.size()];
+}
+
+template <typename T>
+size_t RingHistory<T>::size() const
+{
+    return count;
+}
+
+template <typename T>
+size_t RingHistory<T>::capacity() const
+{
+    return entries.size();
+}
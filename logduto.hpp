@@ -1,8 +1,18 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
 #include <ctime>
-#include <regex>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bodystore.hpp"
+#include "compress.hpp"
+#include "filename.hpp"
 #include "targetfile.hpp"
 #include "util.hpp"
 
@@ -12,6 +22,9 @@ string removeLastNewLine(string str);
 
 string removeLastSlash(string str);
 
+// In place variant of removeLastNewLine, for bodies too large to copy
+void dropLastNewLine(string &str);
+
 string extFromContentType(string contentType);
 
 class ReqData
@@ -25,15 +38,15 @@ public:
     ReqData() = default;
     ReqData(string h, string b, string c);
 
-    string getHeaders();
-    string getBody();
-    string getContentType();
+    const string &getHeaders();
+    const string &getBody();
+    const string &getContentType();
 };
 
 class ResData
 {
 private:
-    int status;
+    int status = 0;
     string headers;
     string body;
     string contentType;
@@ -43,9 +56,9 @@ public:
     ResData(int s, string h, string b, string c);
 
     int getStatus();
-    string getHeaders();
-    string getBody();
-    string getContentType();
+    const string &getHeaders();
+    const string &getBody();
+    const string &getContentType();
 };
 
 class Logduto
@@ -53,22 +66,79 @@ class Logduto
 private:
     string method;
     string path;
+    string params;
     ReqData reqData;
     ResData resData;
     bool saveRequestData = false;
     bool saveResponseData = false;
+    time_t created = 0;
+    int64_t createdMs = 0;
+    uint32_t latency = 0;
+
+    // Digests of the bodies dumped to the body store
+    string reqDigest;
+    string resDigest;
+
+    string logPath;
+    ofstream logStream;
+    unique_ptr<BlobStream> reqStream;
+    unique_ptr<BlobStream> resStream;
+    bool streamingResponse = false;
+
+    string logFilePath(const char *extension);
+    string dataFilePath(string kind, string contentType);
+    void writeHead(ostream &out);
+    void writeResponseHead(ostream &out);
+    void writeBody(ostream &out, const char *kind, const string &body, const string &digest);
+    string saveDataFile(string kind, const string &body, const string &contentType);
+    string finishDataStream(unique_ptr<BlobStream> &stream, string kind, const string &contentType);
+    void endRequestStream();
 
 public:
     string logsDir;
 
+    // saveToFile writes a gzip compressed .log.gz instead
+    bool compress = false;
+
+    // Where data dumps go; the .log refers to dumped bodies by digest
+    BodyStore *bodyStore = nullptr;
+
+    LogLayout layout = LogLayout::Flat;
+
+    Logduto() = default;
     Logduto(string mtd, string pth, bool saveReq, bool saveRes);
 
+    string getMethod();
+    string getPath();
+    ReqData &getReqData();
+    ResData &getResData();
+    int64_t getCreatedMs();
+    uint32_t getLatency();
+
+    // Path of the .log claimed by saveToFile or beginStream
+    const string &getLogPath();
+
+    // Time spent waiting on the upstream, in microseconds
+    void setLatency(uint32_t micros);
+
     void setReqData(ReqData req);
     void setResData(ResData res);
 
-    void saveToFile();
+    // Query and form parameters as parsed, one "name: value" per line
+    void setParams(string p);
+
+    // Both return the size of the .log written, 0 if it failed
+    uint64_t saveToFile();
+    void saveDataFiles();
 
-    static void saveCalls(string dir, string message);
+    // Incremental variant of saveToFile for streamed bodies
+    void beginStream();
+    void streamRequestBody(const char *data, size_t length);
+    void streamResponse(ResData res);
+    void streamResponseBody(const char *data, size_t length);
+    uint64_t endStream();
+
+    static string formatCall(string message, time_t when);
 };
 
 string removeLastNewLine(string str)
@@ -76,6 +146,12 @@ string removeLastNewLine(string str)
     return (!str.empty() && str[str.length() - 1] == '\n') ? str.substr(0, str.length() - 1) : str;
 }
 
+void dropLastNewLine(string &str)
+{
+    if (!str.empty() && str.back() == '\n')
+        str.pop_back();
+}
+
 string removeLastSlash(string str)
 {
     return (!str.empty() && str[str.length() - 1] == '/') ? str.substr(0, str.length() - 1) : str;
@@ -93,22 +169,26 @@ string extFromContentType(string contentType)
 
 ReqData::ReqData(string h, string b, string c)
 {
-    headers = removeLastNewLine(h);
-    body = removeLastNewLine(b);
-    contentType = removeLastNewLine(c);
+    headers = move(h);
+    body = move(b);
+    contentType = move(c);
+
+    dropLastNewLine(headers);
+    dropLastNewLine(body);
+    dropLastNewLine(contentType);
 }
 
-string ReqData::getBody()
+const string &ReqData::getBody()
 {
     return body;
 }
 
-string ReqData::getHeaders()
+const string &ReqData::getHeaders()
 {
     return headers;
 }
 
-string ReqData::getContentType()
+const string &ReqData::getContentType()
 {
     return contentType;
 }
@@ -116,9 +196,13 @@ string ReqData::getContentType()
 ResData::ResData(int s, string h, string b, string c)
 {
     status = s;
-    headers = removeLastNewLine(h);
-    body = removeLastNewLine(b);
-    contentType = removeLastNewLine(c);
+    headers = move(h);
+    body = move(b);
+    contentType = move(c);
+
+    dropLastNewLine(headers);
+    dropLastNewLine(body);
+    dropLastNewLine(contentType);
 }
 
 int ResData::getStatus()
@@ -126,17 +210,17 @@ int ResData::getStatus()
     return status;
 }
 
-string ResData::getHeaders()
+const string &ResData::getHeaders()
 {
     return headers;
 }
 
-string ResData::getBody()
+const string &ResData::getBody()
 {
     return body;
 }
 
-string ResData::getContentType()
+const string &ResData::getContentType()
 {
     return contentType;
 }
@@ -147,151 +231,347 @@ Logduto::Logduto(string mtd, string pth, bool saveReq, bool saveRes)
     path = removeLastSlash(removeLastNewLine(pth));
     saveRequestData = saveReq;
     saveResponseData = saveRes;
+    createdMs = nowMillis();
+    created = createdMs / 1000;
+}
+
+string Logduto::getMethod()
+{
+    return method;
+}
+
+string Logduto::getPath()
+{
+    return path;
+}
+
+ReqData &Logduto::getReqData()
+{
+    return reqData;
+}
+
+ResData &Logduto::getResData()
+{
+    return resData;
+}
+
+int64_t Logduto::getCreatedMs()
+{
+    return createdMs;
+}
+
+uint32_t Logduto::getLatency()
+{
+    return latency;
+}
+
+const string &Logduto::getLogPath()
+{
+    return logPath;
+}
+
+void Logduto::setLatency(uint32_t micros)
+{
+    latency = micros;
 }
 
 void Logduto::setReqData(ReqData req)
 {
-    reqData = req;
+    reqData = move(req);
 }
 
 void Logduto::setResData(ResData res)
 {
-    resData = res;
+    resData = move(res);
 }
 
-void Logduto::saveToFile()
+void Logduto::setParams(string p)
 {
-    try
+    params = move(p);
+}
+
+string Logduto::logFilePath(const char *extension)
+{
+    string filePath;
+    uint64_t suffix = 0;
+
+    // Claim the name exclusively so requests to the same path within the
+    // same second get distinct files instead of overwriting each other
+    while (true)
     {
-        time_t now = time(0);
-        string date = ctime(&now);
-        date = removeLastNewLine(regex_replace(date, regex("  "), " "));
+        buildLogFileName(filePath, logsDir, layout, method, path, created, suffix, extension);
+
+        int fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0)
+        {
+            ::close(fd);
+            logPath = filePath;
+            return filePath;
+        }
+
+        if (errno == ENOENT)
+            filesystem::create_directories(filesystem::path(filePath).parent_path());
+        else if (errno == EEXIST)
+            suffix = nextLogFileSuffix();
+        else
+            return filePath;
+    }
+}
 
-        string dateFormat = currentDateStr() + "_" + currentTimeStr();
+string Logduto::dataFilePath(string kind, string contentType)
+{
+    target_file tfile = resolve_file(path);
 
-        target_file tfile = resolve_file(path);
+    string dir = logsDir + "/data/" + kind + "/";
+    appendMethodName(dir, method);
+    dir += "/";
+    dir += tfile.path[0] == '/' ? "" : "/";
+    dir += tfile.path.substr(0, tfile.path.find_last_of("/"));
 
-        filesystem::create_directories(logsDir);
+    filesystem::create_directories(dir);
+    return dir + "/" + tfile.basename + extFromContentType(contentType);
+}
 
-        string logFileName = method + regex_replace(path, regex("/"), "_") + "_" + dateFormat;
-        ofstream logFile(logsDir + "/" + logFileName + ".log");
+void Logduto::writeHead(ostream &out)
+{
+    out << "[DATE]\n"
+        << readableDate(created) << "\n\n";
 
-        logFile << "[DATE]\n"
-                << date << "\n\n";
+    out << "[URL]\n"
+        << method << " " << path << "\n\n";
 
-        logFile << "[URL]\n"
-                << method << " " << path << "\n\n";
+    if (!params.empty())
+        out << "[PARAMS]\n"
+            << params << "\n\n";
 
-        logFile << "[REQUEST HEADERS]\n"
-                << reqData.getHeaders() << "\n\n";
-        logFile << "[REQUEST BODY]\n"
-                << reqData.getBody() << "\n\n";
+    out << "[REQUEST HEADERS]\n"
+        << reqData.getHeaders() << "\n\n";
+}
 
-        logFile << "[RESPONSE STATUS]\n"
-                << resData.getStatus() << "\n\n";
-        logFile << "[RESPONSE HEADERS]\n"
-                << resData.getHeaders() << "\n\n";
-        logFile << "[RESPONSE BODY]\n"
-                << resData.getBody() << "\n";
+void Logduto::writeResponseHead(ostream &out)
+{
+    out << "[RESPONSE STATUS]\n"
+        << resData.getStatus() << "\n\n";
+    out << "[RESPONSE HEADERS]\n"
+        << resData.getHeaders() << "\n\n";
+}
 
-        logFile.close();
+uint64_t Logduto::saveToFile()
+{
+    try
+    {
+        saveDataFiles();
+
+        ostringstream buffer;
+        ofstream logFile;
+        ostream &out = compress ? (ostream &)buffer : logFile;
+
+        if (!compress)
+            logFile.open(logFilePath(".log"));
+
+        writeHead(out);
+        writeBody(out, "REQUEST", reqData.getBody(), reqDigest);
+        out << "\n\n";
 
-        if (saveRequestData || saveResponseData)
+        writeResponseHead(out);
+        writeBody(out, "RESPONSE", resData.getBody(), resDigest);
+        out << "\n";
+
+        if (compress)
         {
-            string reqDir = logsDir + "/data/request/" + method + "/";
-            string resDir = logsDir + "/data/response/" + method + "/";
-
-            string reqResDirectories = tfile.path[0] == '/' ? "" : "/";
-            reqResDirectories += tfile.path.substr(0, tfile.path.find_last_of("/"));
-
-            if (saveRequestData && !reqData.getBody().empty())
-            {
-                reqDir += reqResDirectories;
-                filesystem::create_directories(reqDir);
-                ofstream reqFile(reqDir + "/" + tfile.basename + extFromContentType(reqData.getContentType()));
-                reqFile << reqData.getBody();
-                reqFile.close();
-            }
-
-            if (saveResponseData && !resData.getBody().empty())
-            {
-                resDir += reqResDirectories;
-                filesystem::create_directories(resDir);
-                ofstream resFile(resDir + "/" + tfile.basename + extFromContentType(resData.getContentType()));
-                resFile << resData.getBody();
-                resFile.close();
-            }
+            string text = buffer.str();
+            string compressed;
+            if (!gzipCompress(text.data(), text.size(), compressed))
+                throw runtime_error("Failed to compress log");
+
+            logFile.open(logFilePath(".log.gz"), ios::binary);
+            logFile.write(compressed.data(), compressed.size());
         }
+
+        streamoff size = logFile.tellp();
+        logFile.close();
+        return logFile && size > 0 ? size : 0;
     }
     catch (const exception &e)
     {
         cerr << "Failed to save log file" << endl;
         cerr << e.what() << endl;
+        return 0;
     }
 }
 
-void Logduto::saveCalls(string dir, string message)
+void Logduto::saveDataFiles()
 {
+    if (saveRequestData)
+        reqDigest = saveDataFile("request", reqData.getBody(), reqData.getContentType());
+
+    if (saveResponseData)
+        resDigest = saveDataFile("response", resData.getBody(), resData.getContentType());
+}
+
+// Stores the body once and points its data dump at it; returns the digest,
+// empty if nothing was stored
+string Logduto::saveDataFile(string kind, const string &body, const string &contentType)
+{
+    if (!bodyStore || body.empty())
+        return "";
+
     try
     {
-        filesystem::create_directories(dir);
-        ofstream file(dir + "/logduto.log", ios_base::app);
+        string digest = bodyStore->put(body);
+        if (!digest.empty())
+            bodyStore->link(dataFilePath(kind, contentType), digest);
+        return digest;
+    }
+    catch (const exception &e)
+    {
+        cerr << "Failed to save data file" << endl;
+        cerr << e.what() << endl;
+        return "";
+    }
+}
 
-        string time = currentTimeStr();
-        string date = currentDateStr();
+string Logduto::finishDataStream(unique_ptr<BlobStream> &stream, string kind, const string &contentType)
+{
+    if (!stream)
+        return "";
 
-        file << date << " " << time << " " << message << endl;
+    try
+    {
+        string digest = stream->finish();
+        stream.reset();
+        if (!digest.empty())
+            bodyStore->link(dataFilePath(kind, contentType), digest);
+        return digest;
     }
     catch (const exception &e)
     {
-        cerr << e.what() << '\n';
+        cerr << "Failed to save data file" << endl;
+        cerr << e.what() << endl;
+        return "";
     }
 }
 
-class LogRecord
+// A dumped body is replaced by its digest, so the .log stays small
+void Logduto::writeBody(ostream &out, const char *kind, const string &body, const string &digest)
 {
-private:
-    bool empty = true;
+    if (digest.empty())
+        out << "[" << kind << " BODY]\n"
+            << body;
+    else
+        out << "[" << kind << " BODY SHA256]\n"
+            << digest;
+}
 
-public:
-    string timemin;
-    string method;
-    string path;
-    int statusCode = -1;
-    string statusReason;
-    string error;
+void Logduto::beginStream()
+{
+    try
+    {
+        logStream.open(logFilePath(".log"));
+        writeHead(logStream);
+        if (!saveRequestData || !bodyStore)
+            logStream << "[REQUEST BODY]\n";
+    }
+    catch (const exception &e)
+    {
+        cerr << "Failed to save log file" << endl;
+        cerr << e.what() << endl;
+    }
+}
+
+// Dumped bodies only go to the body store; the .log gets their digest
+// once they are complete
+void Logduto::streamRequestBody(const char *data, size_t length)
+{
+    if (!saveRequestData || !bodyStore)
+    {
+        logStream.write(data, length);
+        return;
+    }
 
-    LogRecord() {}
+    if (length == 0)
+        return;
 
-    LogRecord(string t, string m, string p)
+    try
     {
-        empty = false;
-        timemin = t;
-        method = m;
-        path = p;
+        if (!reqStream)
+            reqStream = make_unique<BlobStream>(bodyStore);
+        reqStream->write(data, length);
+    }
+    catch (const exception &e)
+    {
+        cerr << "Failed to save data file" << endl;
+        cerr << e.what() << endl;
     }
+}
+
+void Logduto::endRequestStream()
+{
+    if (!saveRequestData || !bodyStore)
+        return;
 
-    LogRecord(string t, string m, string p, int s, string r)
+    reqDigest = finishDataStream(reqStream, "request", reqData.getContentType());
+    writeBody(logStream, "REQUEST", "", reqDigest);
+}
+
+void Logduto::streamResponse(ResData res)
+{
+    resData = res;
+    streamingResponse = true;
+
+    endRequestStream();
+    logStream << "\n\n";
+    writeResponseHead(logStream);
+    if (!saveResponseData || !bodyStore)
+        logStream << "[RESPONSE BODY]\n";
+}
+
+void Logduto::streamResponseBody(const char *data, size_t length)
+{
+    if (!saveResponseData || !bodyStore)
     {
-        empty = false;
-        timemin = t;
-        method = m;
-        path = p;
-        statusCode = s;
-        statusReason = r;
+        logStream.write(data, length);
+        return;
     }
 
-    LogRecord(string t, string m, string p, string e)
+    if (length == 0)
+        return;
+
+    try
+    {
+        if (!resStream)
+            resStream = make_unique<BlobStream>(bodyStore);
+        resStream->write(data, length);
+    }
+    catch (const exception &e)
     {
-        empty = false;
-        timemin = t;
-        method = m;
-        path = p;
-        error = e;
+        cerr << "Failed to save data file" << endl;
+        cerr << e.what() << endl;
     }
+}
 
-    bool isEmpty()
+uint64_t Logduto::endStream()
+{
+    if (!streamingResponse)
     {
-        return empty;
+        endRequestStream();
     }
-};
+    else if (saveResponseData && bodyStore)
+    {
+        resDigest = finishDataStream(resStream, "response", resData.getContentType());
+        writeBody(logStream, "RESPONSE", "", resDigest);
+    }
+
+    if (!logStream.is_open())
+        return 0;
+
+    logStream << "\n";
+    streamoff size = logStream.tellp();
+    logStream.close();
+    return logStream && size > 0 ? size : 0;
+}
+
+string Logduto::formatCall(string message, time_t when)
+{
+    return dateStr(when) + " " + timeStr(when) + " " + message + "\n";
+}
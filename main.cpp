@@ -8,15 +8,34 @@
 #include <filesystem>
 #include <thread>
 #include <ctime>
+#include <csignal>
+#include <strings.h>
 #include <vector>
 #include "libs/argparse.hpp"
 #include "libs/termbox2.h"
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 #include "libs/httplib.h"
+#include "accounting.hpp"
+#include "bodystore.hpp"
+#include "calllog.hpp"
+#include "compress.hpp"
+#include "epoll.hpp"
 #include "files.hpp"
+#include "headers.hpp"
+#include "history.hpp"
 #include "logduto.hpp"
+#include "metrics.hpp"
+#include "pool.hpp"
+#include "queue.hpp"
+#include "record.hpp"
+#include "retention.hpp"
+#include "segment.hpp"
+#include "stats.hpp"
+#include "stream.hpp"
+#include "taskqueue.hpp"
 #include "title.hpp"
 #include "tui.hpp"
+#include "writer.hpp"
 
 #define PROGRAM_NAME "logduto"
 #define PROGRAM_VERSION "0.0.7"
@@ -24,35 +43,83 @@
 #define DEFAULT_PORT "8099"
 #define DEFAULT_TIMEOUT "10"
 #define DEFAULT_LOGS_DIR "./logs"
+#define DEFAULT_POOL_SIZE "0"
+#define DEFAULT_POOL_IDLE "30"
+#define DEFAULT_LOG_QUEUE "4096"
+#define DEFAULT_LOG_POLICY "block"
+#define DEFAULT_LOG_WRITERS "1"
+#define DEFAULT_FLUSH_INTERVAL "1000"
+#define DEFAULT_FLUSH_BYTES "65536"
+#define DEFAULT_ROTATE_BYTES "0"
+#define DEFAULT_ROTATE_KEEP "10"
+#define DEFAULT_LOG_LAYOUT "flat"
+#define DEFAULT_MAX_LOG_BYTES "0"
+#define DEFAULT_MAX_LOG_AGE "0"
+#define DEFAULT_MAX_LOG_FILES "0"
+#define DEFAULT_FORMAT "text"
+#define DEFAULT_SEGMENT_BYTES "67108864"
+#define DEFAULT_HISTORY "100000"
+#define DEFAULT_ADMIN_PORT "0"
+#define STREAM_CHUNKS 64
+#define RECORD_FEED_SIZE 4096
+#define MAX_FPS 30
+#define STATS_INTERVAL_MS 1000
+#define HEADLESS_TICK_MS 100
+#define DEFAULT_SHUTDOWN_TIMEOUT "10"
+#define DEFAULT_WORKER_QUEUE "1024"
+#define DEFAULT_READ_TIMEOUT "5"
+#define DEFAULT_WRITE_TIMEOUT "5"
+#define DEFAULT_PAYLOAD_MAX "0"
+#define DEFAULT_ENGINE "httplib"
+#define DEFAULT_LOOPS "2"
+#define DEFAULT_LOG_BODY_BYTES "-1"
 
 using namespace std;
 
-string resourceUrl, host, logsDir;
-bool saveData = false, cleanLogs = false;
-int port, timeout;
-int countFiles = 0;
-float sizeFiles = 0;
+string resourceUrl, host, logsDir, logFormat, engineName;
+bool saveData = false, cleanLogs = false, streamBodies = false, headless = false, quietRecords = false;
+bool compressResponses = false, compressLogs = false, workStealing = false;
+int port, adminPort, timeout, shutdownTimeout, loops, workers, workerQueue, keepAliveMax, keepAliveTimeout, readTimeout, writeTimeout, poolSize, poolIdle, logQueue, logWriters, flushInterval;
+size_t flushBytes, rotateBytes, rotateKeep, segmentBytes, historySize, payloadMax;
+long long logBodyBytes;
+Backpressure logPolicy;
+LogLayout logLayout;
+RetentionLimits retentionLimits;
+LogAccounting logFiles;
 bool logsCleaned = false;
-string sizeUnity = "";
+int statsLine = 0;
 const string sizeUnities[] = {"B", "KB", "MB", "GB"};
 
-void handleResultSuccess(Logduto &logduto, const httplib::Request &req, httplib::Response &res, httplib::Result &result);
+void handleResultSuccess(Logduto &logduto, const httplib::Request &req, httplib::Response &res, httplib::Response &upstreamRes);
 
 void handleResultError(httplib::Response &res);
 
-bool isInvalidHeader(const string &header);
+string formatHeaders(const httplib::Headers &headers, uint8_t skip);
+
+string forwardPath(const httplib::Request &req);
+
+void setBodyProvider(httplib::Request &upstreamReq, const string &body);
+
+string formatParams(const httplib::Params &params);
+
+int inspectSegments(string query);
+
+int readLogFile(string path);
+
+string displayBody(const string &headers, const string &body);
 
 int printUI(int w, int h);
 
-void countLogFiles();
+void drawStatusBar(int w, int h);
 
 int main(int argc, char *argv[])
 {
     argparse::ArgumentParser program(PROGRAM_NAME, PROGRAM_VERSION);
 
     program.add_argument("url")
-        .help("URL to redirect all requests to")
-        .required();
+        .help("URL to redirect all requests to, required unless inspecting")
+        .nargs(argparse::nargs_pattern::optional)
+        .default_value(string(""));
 
     program.add_argument("-H", "--host")
         .help("specify host for the server")
@@ -70,11 +137,159 @@ int main(int argc, char *argv[])
         .help("specify timeout for the client")
         .default_value(DEFAULT_TIMEOUT);
 
+    program.add_argument("--admin-port")
+        .help("serve Prometheus metrics on /metrics at this port, 0 to disable")
+        .default_value(DEFAULT_ADMIN_PORT);
+
+    program.add_argument("--shutdown-timeout")
+        .help("specify seconds to wait for in-flight requests when quitting, exiting with 1 if some are aborted")
+        .default_value(DEFAULT_SHUTDOWN_TIMEOUT);
+
+    program.add_argument("--engine")
+        .help("specify how connections are served: httplib (a worker thread per connection) or epoll (event loops)")
+        .default_value(DEFAULT_ENGINE);
+
+    program.add_argument("--loops")
+        .help("specify how many event loop threads the epoll engine runs")
+        .default_value(DEFAULT_LOOPS);
+
+    program.add_argument("--log-body-bytes")
+        .help("specify how many bytes of each body the epoll engine logs, -1 for all; the rest is spliced between sockets unless saving data")
+        .default_value(DEFAULT_LOG_BODY_BYTES);
+
+    program.add_argument("--workers")
+        .help("specify how many threads serve downstream connections")
+        .default_value(to_string(CPPHTTPLIB_THREAD_POOL_COUNT));
+
+    program.add_argument("--worker-queue")
+        .help("specify how many connections may wait for a worker before new ones get 503, 0 for no limit")
+        .default_value(DEFAULT_WORKER_QUEUE);
+
+    program.add_argument("--keep-alive-max")
+        .help("specify how many requests a downstream connection may send before it is closed")
+        .default_value(to_string(CPPHTTPLIB_KEEPALIVE_MAX_COUNT));
+
+    program.add_argument("--keep-alive-timeout")
+        .help("specify seconds an idle downstream connection is kept open")
+        .default_value(to_string(CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND));
+
+    program.add_argument("--read-timeout")
+        .help("specify seconds to wait for data from a downstream client")
+        .default_value(DEFAULT_READ_TIMEOUT);
+
+    program.add_argument("--write-timeout")
+        .help("specify seconds to wait while sending to a downstream client")
+        .default_value(DEFAULT_WRITE_TIMEOUT);
+
+    program.add_argument("--payload-max")
+        .help("specify the largest request body accepted in bytes, 0 for no limit")
+        .default_value(DEFAULT_PAYLOAD_MAX);
+
+    program.add_argument("--pool-size")
+        .help("specify how many upstream connections to keep open, 0 for as many as --workers")
+        .default_value(DEFAULT_POOL_SIZE);
+
+    program.add_argument("--pool-idle")
+        .help("specify seconds after which an idle upstream connection is closed")
+        .default_value(DEFAULT_POOL_IDLE);
+
+    program.add_argument("--log-queue")
+        .help("specify how many log records may wait to be written")
+        .default_value(DEFAULT_LOG_QUEUE);
+
+    program.add_argument("--log-policy")
+        .help("specify what to do when the log queue is full: block, drop-oldest or drop-newest")
+        .default_value(DEFAULT_LOG_POLICY);
+
+    program.add_argument("--log-writers")
+        .help("specify how many threads write log files")
+        .default_value(DEFAULT_LOG_WRITERS);
+
+    program.add_argument("--flush-interval")
+        .help("specify milliseconds between flushes of logduto.log")
+        .default_value(DEFAULT_FLUSH_INTERVAL);
+
+    program.add_argument("--flush-bytes")
+        .help("specify how many buffered bytes trigger a flush of logduto.log")
+        .default_value(DEFAULT_FLUSH_BYTES);
+
+    program.add_argument("--rotate-bytes")
+        .help("specify the size at which logduto.log is rotated, 0 to disable")
+        .default_value(DEFAULT_ROTATE_BYTES);
+
+    program.add_argument("--rotate-keep")
+        .help("specify how many rotated logduto.log files to keep, 0 to keep all")
+        .default_value(DEFAULT_ROTATE_KEEP);
+
+    program.add_argument("--log-layout")
+        .help("specify how request log files are spread in the logs directory: flat, hour (YYYY/MM/DD/HH/) or hash (256 directories)")
+        .default_value(DEFAULT_LOG_LAYOUT);
+
+    program.add_argument("--max-log-bytes")
+        .help("specify how many bytes of request logs and data dumps to keep, evicting the oldest, 0 for no limit")
+        .default_value(DEFAULT_MAX_LOG_BYTES);
+
+    program.add_argument("--max-log-age")
+        .help("specify seconds after which request logs and data dumps are evicted, 0 for no limit")
+        .default_value(DEFAULT_MAX_LOG_AGE);
+
+    program.add_argument("--max-log-files")
+        .help("specify how many request log files to keep, evicting the oldest, 0 for no limit")
+        .default_value(DEFAULT_MAX_LOG_FILES);
+
+    program.add_argument("-f", "--format")
+        .help("specify how request logs are stored: text (one .log file per request) or segment")
+        .default_value(DEFAULT_FORMAT);
+
+    program.add_argument("--segment-bytes")
+        .help("specify the size at which a new segment file is started")
+        .default_value(DEFAULT_SEGMENT_BYTES);
+
+    program.add_argument("--inspect")
+        .help("prints the segment record with this sequence number, or lists records within FROM..TO dates, and exits");
+
+    program.add_argument("--read")
+        .help("prints a request log file, restoring bodies dumped to --logs and inflating gzip, and exits");
+
+    program.add_argument("--history")
+        .help("specify how many records are kept for scrolling back")
+        .default_value(DEFAULT_HISTORY);
+
+    program.add_argument("--headless")
+        .help("runs without the terminal UI, printing records to stdout as JSON lines until SIGINT or SIGTERM")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("-q", "--quiet")
+        .help("doesn't print records in headless mode")
+        .default_value(false)
+        .implicit_value(true);
+
     program.add_argument("-d", "--data")
         .help("saves requests and responses to files")
         .default_value(false)
         .implicit_value(true);
 
+    program.add_argument("-s", "--stream")
+        .help("streams request and response bodies instead of buffering them")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--compress")
+        .help("gzips uncompressed 200 responses for clients that accept it (httplib engine)")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--compress-logs")
+        .help("stores request logs gzip compressed (.log.gz, or compressed bodies in segments)")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--work-stealing")
+        .help("gives each worker its own connection queue, idle workers taking from busy ones, instead of one shared queue (httplib engine)")
+        .default_value(false)
+        .implicit_value(true);
+
     program.add_argument("-c", "--clean")
         .help("cleans log files")
         .default_value(false)
@@ -87,10 +302,100 @@ int main(int argc, char *argv[])
         resourceUrl = program.get<string>("url");
         host = program.get<string>("--host");
         port = stoi(program.get<string>("--port"));
+        adminPort = stoi(program.get<string>("--admin-port"));
         saveData = program.get<bool>("--data");
         logsDir = program.get<string>("--logs");
         timeout = stoi(program.get<string>("--timeout"));
+        shutdownTimeout = stoi(program.get<string>("--shutdown-timeout"));
         cleanLogs = program.get<bool>("--clean");
+        streamBodies = program.get<bool>("--stream");
+        compressResponses = program.get<bool>("--compress");
+        compressLogs = program.get<bool>("--compress-logs");
+        headless = program.get<bool>("--headless");
+        quietRecords = program.get<bool>("--quiet");
+        workStealing = program.get<bool>("--work-stealing");
+        poolSize = stoi(program.get<string>("--pool-size"));
+        engineName = program.get<string>("--engine");
+        loops = stoi(program.get<string>("--loops"));
+        logBodyBytes = stoll(program.get<string>("--log-body-bytes"));
+        workers = stoi(program.get<string>("--workers"));
+        workerQueue = stoi(program.get<string>("--worker-queue"));
+        keepAliveMax = stoi(program.get<string>("--keep-alive-max"));
+        keepAliveTimeout = stoi(program.get<string>("--keep-alive-timeout"));
+        readTimeout = stoi(program.get<string>("--read-timeout"));
+        writeTimeout = stoi(program.get<string>("--write-timeout"));
+        payloadMax = stoul(program.get<string>("--payload-max"));
+        poolIdle = stoi(program.get<string>("--pool-idle"));
+
+        logQueue = stoi(program.get<string>("--log-queue"));
+        logPolicy = backpressureFromString(program.get<string>("--log-policy"));
+        logWriters = stoi(program.get<string>("--log-writers"));
+        flushInterval = stoi(program.get<string>("--flush-interval"));
+        flushBytes = stoul(program.get<string>("--flush-bytes"));
+        rotateBytes = stoul(program.get<string>("--rotate-bytes"));
+        rotateKeep = stoul(program.get<string>("--rotate-keep"));
+        logLayout = logLayoutFromString(program.get<string>("--log-layout"));
+        retentionLimits.bytes = stoull(program.get<string>("--max-log-bytes"));
+        retentionLimits.age = stoll(program.get<string>("--max-log-age")) * 1000;
+        retentionLimits.files = stoull(program.get<string>("--max-log-files"));
+        logFormat = program.get<string>("--format");
+        segmentBytes = stoul(program.get<string>("--segment-bytes"));
+        historySize = stoul(program.get<string>("--history"));
+
+        if (auto query = program.present("--inspect"))
+            exit(inspectSegments(*query));
+
+        if (auto path = program.present("--read"))
+            exit(readLogFile(*path));
+
+        if (resourceUrl.empty())
+            throw runtime_error("URL to redirect requests to is required\n");
+
+        if (logFormat != "text" && logFormat != "segment")
+            throw runtime_error("Unknown log format: " + logFormat + "\n");
+
+        if (logFormat == "segment" && streamBodies)
+            throw runtime_error("Streaming only supports the text log format\n");
+
+        if (logFormat == "segment" && retentionLimits.enabled())
+            throw runtime_error("--max-log-bytes, --max-log-age and --max-log-files only apply to the text log format\n");
+
+        if (compressLogs && streamBodies)
+            throw runtime_error("Compressed logs are not supported with --stream\n");
+
+        if (compressResponses && streamBodies)
+            throw runtime_error("Compressed responses are not supported with --stream\n");
+
+        if (engineName != "httplib" && engineName != "epoll")
+            throw runtime_error("Unknown engine: " + engineName + "\n");
+
+        if (engineName == "epoll" && streamBodies)
+            throw runtime_error("The epoll engine always streams, --stream only applies to httplib\n");
+
+        if (engineName != "epoll" && logBodyBytes >= 0)
+            throw runtime_error("--log-body-bytes only applies to the epoll engine\n");
+
+        if (engineName == "epoll" && compressResponses)
+            throw runtime_error("--compress only applies to the httplib engine\n");
+
+        if (engineName == "epoll" && workStealing)
+            throw runtime_error("--work-stealing only applies to the httplib engine\n");
+
+        if (loops < 1)
+            throw runtime_error("Loops must be at least 1\n");
+
+        if (workers < 1 || workerQueue < 0)
+            throw runtime_error("Workers must be at least 1 and the worker queue not negative\n");
+
+        // Workers beyond the pool size would wait for a connection
+        if (poolSize == 0)
+            poolSize = workers;
+
+        if (poolSize < 1)
+            throw runtime_error("Pool size must not be negative\n");
+
+        if (logQueue < 1 || logWriters < 1)
+            throw runtime_error("Log queue and writers must be at least 1\n");
 
         if (logsDir != DEFAULT_LOGS_DIR)
         {
@@ -109,298 +414,863 @@ int main(int argc, char *argv[])
 
     if (cleanLogs)
     {
-        logsCleaned = cleanLogFiles(logsDir);
+        logsCleaned = cleanLogFiles(logsDir, logLayout);
+    }
+
+    if (retentionLimits.enabled())
+        logFiles.trackFiles();
+    logFiles.seed(logsDir, logLayout, thread::hardware_concurrency());
+
+    // Every thread started from here on inherits the mask, leaving the
+    // signals to the headless loop's sigtimedwait
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+
+    if (headless)
+        pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+    BoundedServer server;
+    ClientPool clientPool(resourceUrl, timeout, poolSize, poolIdle);
+    unique_ptr<SegmentStore> segments;
+    try
+    {
+        if (logFormat == "segment")
+            segments = make_unique<SegmentStore>(logsDir, segmentBytes, compressLogs);
+    }
+    catch (const exception &err)
+    {
+        cerr << err.what();
+        exit(1);
     }
 
-    httplib::Server server;
-    httplib::Client client(resourceUrl);
+    // Data dumps are kept once per distinct body; retention also evicts
+    // those of earlier runs
+    unique_ptr<BodyStore> bodyStore;
+    if (saveData || retentionLimits.enabled())
+        bodyStore = make_unique<BodyStore>(logsDir);
+
+    unique_ptr<LogRetention> retention;
+    if (retentionLimits.enabled())
+        retention = make_unique<LogRetention>(retentionLimits, logsDir, logFiles, bodyStore.get());
 
-    client.enable_server_certificate_verification(false);
-    client.set_connection_timeout(timeout, 0);
-    client.set_read_timeout(timeout, 0);
-    client.set_write_timeout(timeout, 0);
+    Stats stats;
+    LogWriter logWriter(logQueue, logPolicy, logWriters, segments.get(), &stats, &logFiles);
+    CallLog callLog(logsDir, flushInterval, flushBytes, rotateBytes, rotateKeep);
 
-    tb_init();
+    if (!headless)
+        tb_init();
 
     struct tb_event ev;
     int y = 0, w = tb_width(), h = tb_height();
     int maxLines = maxRecordLines(h);
 
-    vector<LogRecord> records;
+    RecordHistory records(historySize);
 
-    auto printRecords = [&](LogRecord logRecord = LogRecord())
+    // How many records the view is scrolled back from the newest one
+    size_t scroll = 0;
+
+    // Workers only publish records here; the main thread owns termbox
+    BoundedQueue<RecordEvent> recordFeed(RECORD_FEED_SIZE);
+
+    auto pushRecord = [&](RecordEvent event)
     {
-        if (records.size() == maxLines)
-        {
-            records.erase(records.begin());
-        }
-        else if (records.size() > maxLines)
-        {
-            records.erase(records.begin(), records.end() - maxLines);
-        }
+        if (headless && quietRecords)
+            return;
 
-        if (!logRecord.isEmpty())
-        {
-            records.push_back(logRecord);
-        }
+        recordFeed.tryPush(move(event));
+    };
+
+    auto addRecord = [&](const RecordEvent &event)
+    {
+        records.push(event);
+
+        // Keep a scrolled view on the same records while new ones arrive
+        if (scroll > 0 && scroll < records.size())
+            scroll++;
+    };
+
+    auto scrollBy = [&](long lines)
+    {
+        long maxScroll = records.size() > (size_t)maxLines ? records.size() - maxLines : 0;
+        long next = (long)scroll + lines;
+        scroll = next < 0 ? 0 : (next > maxScroll ? maxScroll : next);
+    };
 
-        int line = 0;
+    auto drawRecords = [&]()
+    {
         string emptyStr(w, ' ');
 
-        for (LogRecord record : records)
+        size_t end = records.size() > scroll ? records.size() - scroll : 0;
+        size_t start = end > (size_t)maxLines ? end - maxLines : 0;
+
+        for (int line = 0; line < maxLines; line++)
         {
             // Clear previous result
             tb_printf(0, y + line, 0, 0, emptyStr.c_str());
-            tb_printf(0, y + (line + 1), 0, 0, emptyStr.c_str());
 
-            bool hasError = !record.error.empty();
+            if (start + line >= end)
+                continue;
+
+            const LogRecord &record = records.at(start + line);
+
+            bool hasError = record.hasError();
+            const char *method = records.methodName(record);
 
             auto ARROW_ICON = record.statusCode == -1 ? UP_ICON : DOWN_ICON;
-            auto resultMessage = record.statusCode == -1 ? "" : to_string(record.statusCode) + " " + record.statusReason;
+            auto resultMessage = record.statusCode == -1 ? "" : to_string(record.statusCode) + " " + records.reasonPhrase(record);
             string icon = hasError ? X_ICON : ARROW_ICON;
-            string message = hasError ? record.error : resultMessage;
+            string message = hasError ? records.text(record.error) : resultMessage;
 
-            tb_printf(0, y + line, 0, 0, "%s", record.timemin.c_str());
+            tb_printf(0, y + line, 0, 0, "%s", timeStr(record.time).c_str());
             tb_printf(9, y + line, hasError ? TB_RED : TB_BLUE, 0, "%s", icon.c_str());
-            tb_printf(11, y + line, 0, methodColor(record.method), " %s ", record.method.c_str());
-            tb_printf(record.method.size() + 14, y + line, hasError ? TB_RED : 0, 0, "%s %s", record.path.c_str(), message.c_str());
-            line++;
+            tb_printf(11, y + line, 0, methodColor(record.method), " %s ", method);
+            tb_printf(strlen(method) + 14, y + line, hasError ? TB_RED : 0, 0, "%s %s", records.text(record.path).c_str(), message.c_str());
         }
+    };
+
+    // Rates and percentiles cover the last STATS_INTERVAL_MS
+    StatsSnapshot lastStats;
+    auto lastStatsAt = chrono::steady_clock::now();
+
+    auto drawStats = [&]()
+    {
+        auto now = chrono::steady_clock::now();
+        StatsSnapshot current = stats.snapshot();
+        StatsSnapshot window = current.since(lastStats);
+        double seconds = chrono::duration<double>(now - lastStatsAt).count();
 
-        tb_present();
+        lastStats = move(current);
+        lastStatsAt = now;
+
+        double rps = seconds > 0 ? window.completed / seconds : 0;
+        double errorRate = window.completed > 0 ? 100.0 * window.errors / window.completed : 0;
+
+        string emptyStr(w, ' ');
+        tb_printf(0, statsLine, 0, 0, emptyStr.c_str());
+        tb_printf(0, statsLine, 0, 0, "%.1f req/s  %llu in flight  p50 %s  p95 %s  p99 %s  %.1f%% errors",
+                  rps, (unsigned long long)lastStats.inFlight(),
+                  formatLatency(window.percentile(0.50)).c_str(),
+                  formatLatency(window.percentile(0.95)).c_str(),
+                  formatLatency(window.percentile(0.99)).c_str(),
+                  errorRate);
+
+        drawStatusBar(w, h);
     };
 
     auto controller = [&](const httplib::Request &req, httplib::Response &res)
     {
-        string path = req.matches[0].str();
+        string path = forwardPath(req);
         string method = req.method;
-        string contentType = req.has_header("Content-Type") ? req.get_header_value("Content-Type") : "text/plain";
 
-        string timemin = currentTimeStr();
+        auto started = chrono::steady_clock::now();
+        stats.begin();
 
         try
         {
-            httplib::Result result;
-            httplib::Params params;
-            httplib::Headers headers;
-            string body = "";
-            string queryParams = "";
-            bool withHeaders = false;
-            bool withParams = false;
-            bool withBody = false;
-            bool withHeadersAndParams = false;
-            bool withHeadersAndBody = false;
-
-            // Handle headers
-            if (!req.headers.empty())
+            Logduto logduto(method, path, saveData, saveData);
+            logduto.logsDir = logsDir;
+            logduto.compress = compressLogs;
+            logduto.layout = logLayout;
+            logduto.bodyStore = bodyStore.get();
+            logduto.setParams(formatParams(req.params));
+
+            callLog.write("[↑] " + method + " " + path);
+            pushRecord(RecordEvent(time(0), method, path));
+
+            // One request whatever the method, carrying every header and the
+            // body as received
+            httplib::Request upstreamReq;
+            upstreamReq.method = method;
+            upstreamReq.path = path;
+            setBodyProvider(upstreamReq, req.body);
+
+            // The client recomputes framing and its own connection headers
+            const string &connection = headerValue(req.headers, "Connection");
+            for (auto &header : req.headers)
             {
-                withHeaders = true;
-                for (auto &header : req.headers)
-                {
-                    if (isInvalidHeader(header.first))
-                        continue;
-                    headers.insert({header.first, header.second});
-                }
+                if (isForwardedHeader(header.first, HEADER_HOP | HEADER_FRAMING | HEADER_LOCAL, connection))
+                    upstreamReq.headers.insert(header);
             }
 
-            // Handle params
-            if (!req.params.empty())
-            {
-                withParams = true;
-                queryParams = "?";
-                for (auto &param : req.params)
-                {
-                    queryParams += param.first + "=" + param.second + "&";
-                    params.insert({param.first, param.second});
-                }
-                queryParams.pop_back();
-                path += queryParams;
-            }
+            auto upstream = clientPool.acquire();
+
+            httplib::Response upstreamRes;
+            auto err = httplib::Error::Success;
+            bool sent = upstream.client().send(upstreamReq, upstreamRes, err);
+
+            logduto.setLatency(elapsedMicros(started));
 
-            // Handle body
-            if (!req.body.empty())
+            if (sent)
             {
-                withBody = true;
-                body = req.body;
+                pushRecord(RecordEvent(time(0), method, path, upstreamRes.status, upstreamRes.reason));
+                callLog.write("[↓] " + method + " " + path + " " + to_string(upstreamRes.status) + " - " + upstreamRes.reason);
+                stats.end(httpMethodFromString(method), upstreamRes.status, logduto.getLatency());
+                stats.addBytes(req.body.size(), upstreamRes.body.size());
+                handleResultSuccess(logduto, req, res, upstreamRes);
+                logWriter.save(move(logduto));
+                return;
             }
 
-            Logduto logduto(method, path, saveData, saveData);
-            logduto.logsDir = logsDir;
+            upstream.markFailed();
+            throw runtime_error("Error: " + httplib::to_string(err));
+        }
+        catch (const exception &e)
+        {
+            string err = e.what();
+            stats.end(httpMethodFromString(method), 0, elapsedMicros(started));
+            pushRecord(RecordEvent(time(0), method, path, err));
+            callLog.write("[✗] " + method + " " + path + " " + err);
+            handleResultError(res);
+        }
+    };
 
-            Logduto::saveCalls(logduto.logsDir, "[↑] " + method + " " + path);
+    // Upstream responses of streamed requests are read here. A worker waits
+    // on at most one relay at a time, so one thread per worker is enough.
+    unique_ptr<RelayPool> relayPool;
+    if (streamBodies)
+        relayPool = make_unique<RelayPool>(workers);
 
-            withHeadersAndParams = withHeaders && withParams;
-            withHeadersAndBody = withHeaders && withBody;
+    // Forwards while holding at most STREAM_CHUNKS body chunks in memory;
+    // bodies are teed to the log writer as they pass through
+    auto streamController = [&](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader *reader)
+    {
+        string path = forwardPath(req);
+        string method = req.method;
+        string contentType = req.has_header("Content-Type") ? req.get_header_value("Content-Type") : "text/plain";
 
-            printRecords(LogRecord(timemin, method, path));
+        Logduto logduto(method, path, saveData, saveData);
+        logduto.logsDir = logsDir;
+        logduto.bodyStore = bodyStore.get();
+        logduto.layout = logLayout;
+        logduto.setParams(formatParams(req.params));
+        logduto.setReqData(ReqData(formatHeaders(req.headers, HEADER_LOCAL), "", contentType));
+        auto log = logWriter.beginStream(move(logduto));
 
-            if (method == "OPTIONS")
-            {
-                result = client.Options(path, headers);
-            }
-            else if (method == "POST")
+        auto started = chrono::steady_clock::now();
+        stats.begin();
+
+        callLog.write("[↑] " + method + " " + path);
+        pushRecord(RecordEvent(time(0), method, path));
+
+        httplib::Request upstreamReq;
+        upstreamReq.method = method;
+        upstreamReq.path = path;
+
+        const string &connection = headerValue(req.headers, "Connection");
+        for (auto &header : req.headers)
+        {
+            if (isForwardedHeader(header.first, HEADER_HOP | HEADER_FRAMING | HEADER_LOCAL, connection))
+                upstreamReq.headers.insert(header);
+        }
+
+        // The reader belongs to the worker, which hands the body over to
+        // the relay thread sending it
+        auto upload = make_shared<StreamRelay>(STREAM_CHUNKS);
+
+        if (reader)
+        {
+            auto sendChunk = [upload, log, &stats](httplib::DataSink &sink)
             {
-                if (withHeadersAndParams)
-                    result = client.Post(path, headers, params);
-                else if (withHeadersAndBody)
-                    result = client.Post(path, headers, body, contentType);
-                else if (withHeaders)
-                    result = client.Post(path, headers);
-                else if (withParams)
-                    result = client.Post(path, params);
-                else if (withBody)
-                    result = client.Post(path, body, contentType);
-                else
-                    result = client.Post(path);
-            }
-            else if (req.method == "PUT")
+                string chunk;
+                if (!upload->pop(chunk))
+                    return false;
+                log->requestBody(chunk.data(), chunk.size());
+                stats.addBytes(chunk.size(), 0);
+                return sink.write(chunk.data(), chunk.size());
+            };
+
+            bool chunked = req.get_header_value("Transfer-Encoding") == "chunked";
+            if (!chunked && req.has_header("Content-Length"))
             {
-                if (withHeadersAndParams)
-                    result = client.Put(path, headers, params);
-                else if (withHeadersAndBody)
-                    result = client.Put(path, headers, body, contentType);
-                else if (withParams)
-                    result = client.Put(path, params);
-                else if (withBody)
-                    result = client.Put(path, body, contentType);
-                else
-                    result = client.Put(path);
+                upstreamReq.content_length_ = req.get_header_value_u64("Content-Length");
+                upstreamReq.content_provider_ = [sendChunk](size_t, size_t, httplib::DataSink &sink)
+                {
+                    return sendChunk(sink);
+                };
             }
-            else if (req.method == "PATCH")
+            else
             {
-                if (withHeadersAndBody)
-                    result = client.Patch(path, headers, body, contentType);
-                else if (withBody)
-                    result = client.Patch(path, body, contentType);
-                else
-                    result = client.Patch(path);
+                upstreamReq.set_header("Transfer-Encoding", "chunked");
+                upstreamReq.is_chunked_content_provider_ = true;
+                upstreamReq.content_provider_ = [sendChunk, upload](size_t, size_t, httplib::DataSink &sink)
+                {
+                    if (sendChunk(sink))
+                        return true;
+                    if (!upload->getError().empty())
+                        return false;
+                    sink.done();
+                    return true;
+                };
             }
-            else if (req.method == "DELETE")
+        }
+        else if (!req.body.empty())
+        {
+            // The worker waits for the response, so the request body outlives the send
+            setBodyProvider(upstreamReq, req.body);
+            log->requestBody(req.body.data(), req.body.size());
+        }
+
+        auto relay = make_shared<StreamRelay>(STREAM_CHUNKS);
+
+        auto forward = [&, relay, upload, log, method, path, upstreamReq]() mutable
+        {
+            bool responded = false;
+
+            try
             {
-                if (withHeadersAndBody)
-                    result = client.Delete(path, headers, body, contentType);
-                else if (withHeaders)
-                    result = client.Delete(path, headers);
-                else if (withBody)
-                    result = client.Delete(path, body, contentType);
+                auto upstream = clientPool.acquire();
+
+                auto onResponse = [&](const httplib::Response &response)
+                {
+                    string resCtnType = response.has_header("Content-Type") ? response.get_header_value("Content-Type") : "text/plain";
+                    log->response(ResData(response.status, formatHeaders(response.headers, 0), "", resCtnType));
+                    relay->setResponse(response);
+                    responded = true;
+                    return true;
+                };
+
+                upstreamReq.response_handler = onResponse;
+
+                upstreamReq.content_receiver = [&](const char *data, size_t length, uint64_t, uint64_t)
+                {
+                    log->responseBody(data, length);
+                    stats.addBytes(0, length);
+                    return relay->push(data, length);
+                };
+
+                auto result = upstream.client().send(upstreamReq);
+
+                if (result)
+                {
+                    // HEAD and 204 responses skip the response handler
+                    if (!responded)
+                        onResponse(result.value());
+                    relay->finish();
+                }
                 else
-                    result = client.Delete(path);
+                {
+                    upstream.markFailed();
+                    relay->finish("Error: " + httplib::to_string(result.error()));
+                }
             }
-            else // Default GET
+            catch (const exception &e)
             {
-                if (withHeaders)
-                    result = client.Get(path, headers);
-                else
-                    result = client.Get(path);
+                relay->finish(e.what());
             }
 
-            if (result)
+            // Whatever of the body is left, the worker stops reading it
+            upload->cancel();
+            log->end();
+
+            string err = relay->getError();
+            if (responded && !err.empty())
+                callLog.write("[✗] " + method + " " + path + " " + err);
+
+            relay->close();
+        };
+
+        relayPool->run(forward);
+
+        if (reader)
+        {
+            bool complete = (*reader)([&](const char *data, size_t length)
+                                      { return upload->push(data, length); });
+            upload->finish(complete ? "" : "Request body not fully read");
+
+            // The rest of the body would be parsed as the next request
+            if (!complete)
+                BoundedServer::closeConnection(res);
+        }
+
+        if (!relay->waitResponse())
+        {
+            relay->waitClosed();
+            stats.end(httpMethodFromString(method), 0, elapsedMicros(started));
+            callLog.write("[✗] " + method + " " + path + " " + relay->getError());
+            pushRecord(RecordEvent(time(0), method, path, relay->getError()));
+            handleResultError(res);
+            return;
+        }
+
+        stats.end(httpMethodFromString(method), relay->status, elapsedMicros(started));
+        pushRecord(RecordEvent(time(0), method, path, relay->status, relay->reason));
+        callLog.write("[↓] " + method + " " + path + " " + to_string(relay->status) + " - " + relay->reason);
+
+        string resCtnType = "text/plain";
+        const string &resConnection = headerValue(relay->headers, "Connection");
+        for (auto &header : relay->headers)
+        {
+            if (!isForwardedHeader(header.first, HEADER_HOP | HEADER_FRAMING, resConnection))
+                continue;
+            if (strcasecmp(header.first.c_str(), "Content-Type") == 0)
             {
-                printRecords(LogRecord(currentTimeStr(), method, path, result->status, result->reason));
-                Logduto::saveCalls(logduto.logsDir, "[↓] " + method + " " + path + " " + to_string(result->status) + " - " + result->reason);
-                handleResultSuccess(logduto, req, res, result);
-                return;
+                resCtnType = header.second;
+                continue;
             }
+            res.set_header(header.first, header.second);
+        }
 
-            auto err = result.error();
-            throw runtime_error("Error: " + httplib::to_string(err));
+        res.status = relay->status;
+
+        auto release = [relay](bool)
+        {
+            relay->cancel();
+            relay->waitClosed();
+        };
+
+        bool chunked = relay->headers.find("Transfer-Encoding") != relay->headers.end();
+        auto contentLength = relay->headers.find("Content-Length");
+
+        if (!chunked && contentLength != relay->headers.end())
+        {
+            res.set_content_provider(
+                stoull(contentLength->second), resCtnType,
+                [relay](size_t, size_t, httplib::DataSink &sink)
+                {
+                    string chunk;
+                    return relay->pop(chunk) && sink.write(chunk.data(), chunk.size());
+                },
+                release);
         }
-        catch (const exception &e)
+        else
         {
-            string err = e.what();
-            printRecords(LogRecord(currentTimeStr(), method, path, err));
-            Logduto::saveCalls(logsDir, "[✗] " + method + " " + path + " " + err);
-            handleResultError(res);
+            res.set_chunked_content_provider(
+                resCtnType,
+                [relay](size_t, httplib::DataSink &sink)
+                {
+                    string chunk;
+                    if (relay->pop(chunk))
+                        return sink.write(chunk.data(), chunk.size());
+                    if (!relay->getError().empty())
+                        return false;
+                    sink.done();
+                    return true;
+                },
+                release);
         }
     };
 
+    server.new_task_queue = [&]
+    { return new BoundedTaskQueue(workers, workerQueue, workStealing); };
+
+    server.set_keep_alive_max_count(keepAliveMax);
+    server.set_keep_alive_timeout(keepAliveTimeout);
+    server.set_read_timeout(readTimeout);
+    server.set_write_timeout(writeTimeout);
+    if (payloadMax > 0)
+        server.set_payload_max_length(payloadMax);
+
+    // Connections the workers had no room for are answered here, and so are
+    // the methods httplib has no routes for
+    server.set_pre_routing_handler([&](const httplib::Request &req, httplib::Response &res)
+                                   {
+        if (!BoundedTaskQueue::isRejecting())
+        {
+            if (req.method != "TRACE" && req.method != "CONNECT")
+                return httplib::Server::HandlerResponse::Unhandled;
+
+            // httplib has not read the body yet and never will, so it must
+            // not be parsed as the next request
+            if (req.has_header("Transfer-Encoding") || req.get_header_value_u64("Content-Length") > 0)
+                BoundedServer::closeConnection(res);
+
+            if (streamBodies)
+                streamController(req, res, nullptr);
+            else
+                controller(req, res);
+            return httplib::Server::HandlerResponse::Handled;
+        }
+
+        stats.reject();
+        res.status = 503;
+        res.set_header("Retry-After", "1");
+        res.set_content("--- Busy ---", "text/plain");
+        return httplib::Server::HandlerResponse::Handled; });
+
     string urlPattern = "(.*)";
 
-    server.Get(urlPattern, controller);
-    server.Post(urlPattern, controller);
-    server.Put(urlPattern, controller);
-    server.Patch(urlPattern, controller);
-    server.Delete(urlPattern, controller);
-    server.Options(urlPattern, controller);
+    if (streamBodies)
+    {
+        auto streamHandler = [&](const httplib::Request &req, httplib::Response &res)
+        {
+            streamController(req, res, nullptr);
+        };
+
+        auto streamReaderHandler = [&](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &reader)
+        {
+            streamController(req, res, &reader);
+        };
+
+        server.Get(urlPattern, streamHandler);
+        server.Post(urlPattern, streamReaderHandler);
+        server.Post(urlPattern, streamHandler);
+        server.Put(urlPattern, streamReaderHandler);
+        server.Put(urlPattern, streamHandler);
+        server.Patch(urlPattern, streamReaderHandler);
+        server.Patch(urlPattern, streamHandler);
+        server.Delete(urlPattern, streamReaderHandler);
+        server.Delete(urlPattern, streamHandler);
+        server.Options(urlPattern, streamHandler);
+    }
+    else
+    {
+        server.Get(urlPattern, controller);
+        server.Post(urlPattern, controller);
+        server.Put(urlPattern, controller);
+        server.Patch(urlPattern, controller);
+        server.Delete(urlPattern, controller);
+        server.Options(urlPattern, controller);
+    }
+
+    // Same records as the controller, reported from the event loops
+    EpollHooks hooks;
+
+    hooks.onRequest = [&](const EpollExchange &ex)
+    {
+        stats.begin();
+        callLog.write("[↑] " + ex.method + " " + ex.target);
+        pushRecord(RecordEvent(time(0), ex.method, ex.target));
+    };
 
-    bool serverRunning = false;
-    string serverError = "";
+    hooks.onFinish = [&](EpollExchange &ex)
+    {
+        if (!ex.error.empty())
+        {
+            stats.end(httpMethodFromString(ex.method), 0, elapsedMicros(ex.started));
+            pushRecord(RecordEvent(time(0), ex.method, ex.target, ex.error));
+            callLog.write("[✗] " + ex.method + " " + ex.target + " " + ex.error);
+            return;
+        }
 
-    auto startServer = [&]()
+        auto reqCtnType = ex.reqHeaders.find("Content-Type");
+        auto resCtnType = ex.resHeaders.find("Content-Type");
+
+        httplib::Params params;
+        size_t query = ex.target.find('?');
+        if (query != string::npos)
+            httplib::detail::parse_query_text(ex.target.substr(query + 1), params);
+
+        Logduto logduto(ex.method, ex.target, saveData, saveData);
+        logduto.logsDir = logsDir;
+        logduto.compress = compressLogs;
+        logduto.layout = logLayout;
+        logduto.bodyStore = bodyStore.get();
+        logduto.setParams(formatParams(params));
+        logduto.setLatency(ex.latency);
+        logduto.setReqData(ReqData(formatHeaders(ex.reqHeaders, HEADER_LOCAL), move(ex.reqBody),
+                                   reqCtnType != ex.reqHeaders.end() ? reqCtnType->second : "text/plain"));
+        logduto.setResData(ResData(ex.status, formatHeaders(ex.resHeaders, 0), move(ex.resBody),
+                                   resCtnType != ex.resHeaders.end() ? resCtnType->second : "text/plain"));
+
+        pushRecord(RecordEvent(time(0), ex.method, ex.target, ex.status, ex.reason));
+        callLog.write("[↓] " + ex.method + " " + ex.target + " " + to_string(ex.status) + " - " + ex.reason);
+        stats.end(httpMethodFromString(ex.method), ex.status, ex.latency);
+        stats.addBytes(ex.bytesIn, ex.bytesOut);
+        logWriter.save(move(logduto));
+    };
+
+    unique_ptr<EpollEngine> engine;
+    if (engineName == "epoll")
     {
+        // Data files need whole bodies
+        size_t captureBytes = saveData || logBodyBytes < 0 ? SIZE_MAX : logBodyBytes;
+
         try
         {
-            serverRunning = true;
-            server.listen(host, port);
+            engine = make_unique<EpollEngine>(resourceUrl, host, port, loops, timeout, keepAliveTimeout, poolIdle, poolSize, captureBytes, hooks);
         }
-        catch (const exception &e)
+        catch (const exception &err)
+        {
+            if (!headless)
+                tb_shutdown();
+            cerr << err.what();
+            return 1;
+        }
+    }
+
+    atomic<bool> serverDone{false};
+    bool listened = false;
+
+    auto startServer = [&]()
+    {
+        if (engine)
+        {
+            listened = engine->listen();
+            if (listened)
+                engine->run();
+        }
+        else
         {
-            serverError = e.what();
-            serverRunning = false;
+            listened = server.listen(host, port);
         }
+        serverDone = true;
     };
 
-    thread t(startServer);
-    t.detach();
+    // Scrapes only read the stats shards, never the forwarding path's locks
+    httplib::Server admin;
+    thread adminThread;
+
+    if (adminPort > 0)
+    {
+        admin.Get("/metrics", [&](const httplib::Request &, httplib::Response &res)
+                  { res.set_content(formatMetrics(stats.snapshot(), logWriter.depth(), logWriter.droppedCount(), logFiles),
+                                    "text/plain; version=0.0.4"); });
+
+        if (!admin.bind_to_port(host, adminPort))
+        {
+            if (!headless)
+                tb_shutdown();
+            cerr << "Failed to listen on admin port " << adminPort << endl;
+            return 1;
+        }
+
+        adminThread = thread([&]
+                             { admin.listen_after_bind(); });
+    }
+
+    // Waits for the admin server to be up first, stop() is a no-op before
+    auto stopAdmin = [&]()
+    {
+        if (!adminThread.joinable())
+            return;
+
+        admin.wait_until_ready();
+        admin.stop();
+        adminThread.join();
+    };
+
+    auto printRecords = [&]()
+    {
+        string lines;
+        RecordEvent event;
+
+        while (recordFeed.tryPop(event))
+        {
+            lines += formatRecordJson(event);
+            lines += '\n';
+        }
+
+        if (!lines.empty())
+        {
+            fwrite(lines.data(), 1, lines.size(), stdout);
+            fflush(stdout);
+        }
+    };
+
+    thread serverThread(startServer);
+
+    // Stops accepting, gives in-flight requests until the deadline, then
+    // drains and syncs the log pipeline. Exits with 1 if requests were
+    // aborted.
+    auto shutdown = [&]()
+    {
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(shutdownTimeout);
+        auto tick = chrono::milliseconds(HEADLESS_TICK_MS);
+
+        // A signal may arrive before the server started listening
+        while (!serverDone && !(engine ? engine->isRunning() : server.is_running()) && chrono::steady_clock::now() < deadline)
+            this_thread::sleep_for(tick);
 
-    countLogFiles();
+        uint64_t inFlight = stats.snapshot().inFlight();
+
+        if (engine)
+            engine->stop();
+        else
+            server.stop();
+        stopAdmin();
+
+        // listen() and run() return once the open exchanges finished
+        while (!serverDone && chrono::steady_clock::now() < deadline)
+        {
+            if (headless)
+                printRecords();
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+
+        uint64_t aborted = serverDone ? 0 : stats.snapshot().inFlight();
+
+        if (serverDone)
+            serverThread.join();
+
+        if (headless)
+            printRecords();
+
+        logWriter.stop();
+        callLog.stop();
+        if (retention)
+            retention->stop();
+        if (segments)
+            segments->sync();
+        syncLogFiles(logsDir);
+
+        cerr << "Shutdown: " << (inFlight > aborted ? inFlight - aborted : 0) << " in-flight requests drained, "
+             << aborted << " aborted" << endl;
+
+        if (logWriter.droppedCount() > 0)
+            cerr << logWriter.droppedCount() << " log records dropped" << endl;
+
+        if (retention && retention->evictedCount() > 0)
+            cerr << retention->evictedCount() << " old log files evicted" << endl;
+
+        // Workers that missed the deadline still use state owned by main, so
+        // leave without destroying it; the log pipeline is drained by now
+        int status = aborted > 0 ? 1 : 0;
+        if (!serverDone)
+            _exit(status);
+
+        return status;
+    };
+
+    if (headless)
+    {
+        while (!serverDone)
+        {
+            timespec tick{0, HEADLESS_TICK_MS * 1000000L};
+            int signal = sigtimedwait(&stopSignals, nullptr, &tick);
+
+            printRecords();
+
+            if (signal == SIGINT || signal == SIGTERM)
+                break;
+        }
+
+        if (serverDone && !listened)
+        {
+            serverThread.join();
+            stopAdmin();
+            logWriter.stop();
+            callLog.stop();
+            cerr << "Failed to listen on " << host << ":" << port << endl;
+            return 1;
+        }
+
+        return shutdown();
+    }
 
     y = printUI(w, h);
+    drawStats();
+    tb_present();
+
+    // Render loop: coalesce records from the feed and redraw at most
+    // MAX_FPS times per second, only when something changed
+    const auto frameInterval = chrono::milliseconds(1000 / MAX_FPS);
+    auto lastFrame = chrono::steady_clock::now();
+    bool dirty = false;
 
     while (true)
     {
-        tb_poll_event(&ev);
+        auto wait = frameInterval;
+        if (dirty)
+        {
+            auto sinceFrame = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - lastFrame);
+            wait = sinceFrame < frameInterval ? frameInterval - sinceFrame : chrono::milliseconds(0);
+        }
 
-        if (ev.type == TB_EVENT_RESIZE)
+        if (tb_peek_event(&ev, wait.count()) == TB_OK)
         {
-            w = ev.w;
-            h = ev.h;
+            if (ev.type == TB_EVENT_RESIZE)
+            {
+                w = ev.w;
+                h = ev.h;
 
-            maxLines = maxRecordLines(h);
+                maxLines = maxRecordLines(h);
+                scrollBy(0);
 
-            tb_clear();
+                tb_clear();
+                y = printUI(w, h);
+                dirty = true;
+            }
+            else if (ev.key == TB_KEY_PGUP || ev.key == TB_KEY_PGDN || ev.key == TB_KEY_HOME || ev.key == TB_KEY_END ||
+                     ev.key == TB_KEY_ARROW_UP || ev.key == TB_KEY_ARROW_DOWN)
+            {
+                if (ev.key == TB_KEY_PGUP)
+                    scrollBy(maxLines);
+                else if (ev.key == TB_KEY_PGDN)
+                    scrollBy(-maxLines);
+                else if (ev.key == TB_KEY_ARROW_UP)
+                    scrollBy(1);
+                else if (ev.key == TB_KEY_ARROW_DOWN)
+                    scrollBy(-1);
+                else if (ev.key == TB_KEY_HOME)
+                    scrollBy(records.size());
+                else
+                    scroll = 0;
 
-            printRecords();
-            y = printUI(w, h);
+                dirty = true;
+            }
+            else if (ev.key == TB_KEY_CTRL_C || ev.key == TB_KEY_ESC)
+            {
+                tb_shutdown();
+                return shutdown();
+            }
         }
 
-        if (ev.key == 3 || ev.key == 27)
+        RecordEvent event;
+        while (recordFeed.tryPop(event))
         {
-            tb_shutdown();
-            return 0;
+            addRecord(event);
+            dirty = true;
+        }
+
+        if (chrono::steady_clock::now() - lastStatsAt >= chrono::milliseconds(STATS_INTERVAL_MS))
+        {
+            drawStats();
+            dirty = true;
+        }
+
+        if (dirty && chrono::steady_clock::now() - lastFrame >= frameInterval)
+        {
+            drawRecords();
+            tb_present();
+            lastFrame = chrono::steady_clock::now();
+            dirty = false;
         }
     }
 
     return 0;
 }
 
-void handleResultSuccess(Logduto &logduto, const httplib::Request &req, httplib::Response &res, httplib::Result &result)
+void handleResultSuccess(Logduto &logduto, const httplib::Request &req, httplib::Response &res, httplib::Response &upstreamRes)
 {
     string reqCtnType = req.has_header("Content-Type") ? req.get_header_value("Content-Type") : "text/plain";
-    string resCtnType = result->has_header("Content-Type") ? result->get_header_value("Content-Type") : "text/plain";
+    string resCtnType = upstreamRes.has_header("Content-Type") ? upstreamRes.get_header_value("Content-Type") : "text/plain";
 
-    string reqHeaders = "";
-    for (auto &header : req.headers)
+    // httplib sets the framing of the response it sends
+    const string &connection = headerValue(upstreamRes.headers, "Connection");
+    for (auto &header : upstreamRes.headers)
     {
-        if (isInvalidHeader(header.first))
-            continue;
-        reqHeaders += header.first + ": " + header.second + "\n";
+        if (isForwardedHeader(header.first, HEADER_HOP | HEADER_FRAMING, connection))
+            res.set_header(header.first, header.second);
     }
 
-    string resHeaders = "";
-    for (auto &header : result->headers)
-    {
-        resHeaders += header.first + ": " + header.second + "\n";
-        res.set_header(header.first, header.second);
-    }
+    // HEAD responses have no body to derive the length from
+    if (upstreamRes.body.empty() && upstreamRes.has_header("Content-Length"))
+        res.set_header("Content-Length", upstreamRes.get_header_value("Content-Length"));
+
+    logduto.setReqData(ReqData(formatHeaders(req.headers, HEADER_LOCAL), req.body, reqCtnType));
+    logduto.setResData(ResData(upstreamRes.status, formatHeaders(upstreamRes.headers, 0), upstreamRes.body, resCtnType));
 
-    logduto.setReqData(ReqData(reqHeaders, req.body.data(), reqCtnType));
-    logduto.setResData(ResData(result->status, resHeaders, result->body.data(), resCtnType));
+    res.status = upstreamRes.status;
 
-    logduto.saveToFile();
+    // Partial and already encoded bodies pass through untouched, their
+    // ranges only match the bytes the upstream sent
+    bool gzip = compressResponses && req.method != "HEAD" && upstreamRes.status == 200 && upstreamRes.body.size() >= COMPRESS_MIN_BYTES &&
+                !upstreamRes.has_header("Content-Range") && !upstreamRes.has_header("Content-Encoding") &&
+                acceptsGzip(req.get_header_value("Accept-Encoding")) &&
+                httplib::detail::can_compress_content_type(resCtnType);
+
+    string compressed;
+    if (gzip && gzipCompress(upstreamRes.body.data(), upstreamRes.body.size(), compressed))
+    {
+        res.set_header("Content-Encoding", "gzip");
+        res.set_header("Vary", "Accept-Encoding");
+        res.set_content(move(compressed), resCtnType);
+        return;
+    }
 
-    res.status = result->status;
-    res.set_content(result->body, resCtnType);
+    res.set_content(move(upstreamRes.body), resCtnType);
 }
 
 void handleResultError(httplib::Response &res)
@@ -409,13 +1279,187 @@ void handleResultError(httplib::Response &res)
     res.set_content("--- Error ---", "text/plain");
 }
 
-bool isInvalidHeader(const string &header)
+string formatHeaders(const httplib::Headers &headers, uint8_t skip)
+{
+    size_t size = 0;
+    for (auto &header : headers)
+        size += header.first.size() + header.second.size() + 3;
+
+    string str;
+    str.reserve(size);
+    appendHeaderLines(str, headers, skip);
+    return str;
+}
+
+// The request-target exactly as the client sent it, fragment aside
+string forwardPath(const httplib::Request &req)
+{
+    return req.target;
+}
+
+// Sends `body` without copying it into the request, so it must outlive
+// the send
+void setBodyProvider(httplib::Request &upstreamReq, const string &body)
+{
+    if (body.empty())
+        return;
+
+    upstreamReq.content_length_ = body.size();
+    upstreamReq.content_provider_ = [&body](size_t offset, size_t length, httplib::DataSink &sink)
+    {
+        return sink.write(body.data() + offset, length);
+    };
+}
+
+string formatParams(const httplib::Params &params)
+{
+    string str = "";
+    for (auto &param : params)
+    {
+        str += param.first + ": " + param.second + "\n";
+    }
+    return removeLastNewLine(str);
+}
+
+int inspectSegments(string query)
+{
+    auto parseDate = [](string str)
+    {
+        replace(str.begin(), str.end(), 'T', ' ');
+        tm date = {};
+        if (!strptime(str.c_str(), "%Y-%m-%d %H:%M:%S", &date))
+            throw runtime_error("Invalid date: " + str + ", expected YYYY-MM-DD HH:MM:SS\n");
+        date.tm_isdst = -1;
+        return (int64_t)mktime(&date) * 1000;
+    };
+
+    try
+    {
+        SegmentReader reader(logsDir);
+        SegmentRecord record;
+
+        size_t range = query.find("..");
+        if (range == string::npos)
+        {
+            auto entry = reader.entry(stoull(query));
+            if (!entry || !reader.read(*entry, record))
+                throw runtime_error("No record with sequence " + query + "\n");
+
+            cout << "[DATE]\n"
+                 << readableDate(record.timestamp / 1000) << "\n\n";
+            cout << "[URL]\n"
+                 << record.method << " " << record.path << "\n\n";
+            cout << "[LATENCY]\n"
+                 << record.latency / 1000.0 << " ms\n\n";
+            cout << "[REQUEST HEADERS]\n"
+                 << record.reqHeaders << "\n\n";
+            cout << "[REQUEST BODY]\n"
+                 << displayBody(record.reqHeaders, record.reqBody) << "\n\n";
+            cout << "[RESPONSE STATUS]\n"
+                 << record.status << "\n\n";
+            cout << "[RESPONSE HEADERS]\n"
+                 << record.resHeaders << "\n\n";
+            cout << "[RESPONSE BODY]\n"
+                 << displayBody(record.resHeaders, record.resBody) << "\n";
+            return 0;
+        }
+
+        int64_t from = parseDate(query.substr(0, range));
+        int64_t to = parseDate(query.substr(range + 2));
+
+        for (uint64_t seq = reader.lowerBound(from);; seq++)
+        {
+            auto entry = reader.entry(seq);
+            if (!entry || entry->timestamp > to)
+                break;
+            if (!reader.read(*entry, record))
+                continue;
+
+            time_t seconds = record.timestamp / 1000;
+            cout << seq << " " << dateStr(seconds) << " " << timeStr(seconds) << " "
+                 << record.method << " " << record.path << " " << record.status << " "
+                 << record.latency / 1000.0 << " ms\n";
+        }
+        return 0;
+    }
+    catch (const exception &e)
+    {
+        cerr << e.what();
+        return 1;
+    }
+}
+
+int readLogFile(string path)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        cerr << "Failed to open " << path << endl;
+        return 1;
+    }
+
+    string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    if (isGzipped(text))
+    {
+        string plain;
+        if (!gzipDecompress(text.data(), text.size(), plain))
+        {
+            cerr << "Failed to decompress " << path << endl;
+            return 1;
+        }
+        text = move(plain);
+    }
+
+    // Bodies dumped with --data are referenced by digest; the response
+    // comes last, so it is looked up from the end
+    for (bool response : {true, false})
+    {
+        string kind = response ? "RESPONSE" : "REQUEST";
+        string section = "[" + kind + " BODY SHA256]\n";
+        size_t start = response ? text.rfind(section) : text.find(section);
+        if (start == string::npos)
+            continue;
+
+        string digest = text.substr(start + section.size(), BODY_DIGEST_LENGTH);
+        string body;
+        if (!BodyStore::load(logsDir, digest, body))
+        {
+            cerr << "Missing body " << digest << " in " << logsDir << endl;
+            continue;
+        }
+
+        text.replace(start, section.size() + digest.size(), "[" + kind + " BODY]\n" + body);
+    }
+
+    size_t headers = text.find("[RESPONSE HEADERS]\n");
+    size_t body = headers == string::npos ? string::npos : text.find("\n\n[RESPONSE BODY]\n", headers);
+
+    if (body != string::npos)
+    {
+        size_t headersStart = headers + strlen("[RESPONSE HEADERS]\n");
+        size_t bodyStart = body + strlen("\n\n[RESPONSE BODY]\n");
+
+        string resHeaders = text.substr(headersStart, body - headersStart);
+        string resBody = removeLastNewLine(text.substr(bodyStart));
+
+        text.resize(bodyStart);
+        text += displayBody(resHeaders, resBody);
+        text += "\n";
+    }
+
+    cout << text;
+    return 0;
+}
+
+// Inflates a body that was logged as the upstream sent it, gzip encoded
+string displayBody(const string &headers, const string &body)
 {
-    return header == "Host" ||
-           header == "LOCAL_ADDR" ||
-           header == "LOCAL_PORT" ||
-           header == "REMOTE_ADDR" ||
-           header == "REMOTE_PORT";
+    if (!isGzipped(body) || !strcasestr(headers.c_str(), "Content-Encoding: gzip"))
+        return body;
+
+    string plain;
+    return gzipDecompress(body.data(), body.size(), plain) ? plain : body;
 }
 
 int printUI(int w, int h)
@@ -423,7 +1467,6 @@ int printUI(int w, int h)
     int y = 0;
     string from = "http://" + host + ":" + to_string(port);
     string to = resourceUrl;
-    string emptyStr(w, ' ');
 
     // Print Title
     for (const string s : title_array)
@@ -437,50 +1480,37 @@ int printUI(int w, int h)
     tb_printf(16, y, TB_GREEN, 0, from.c_str());
     tb_printf(from.size() + 16, y, 0, 0, " to ");
     tb_printf(from.size() + 20, y++, TB_RED, 0, to.c_str());
-    tb_printf(0, y++, 0, 0, "Press Esc or Ctrl-C to quit");
+    tb_printf(0, y++, 0, 0, "Press Esc or Ctrl-C to quit, PgUp/PgDn/Home/End to scroll");
+    statsLine = y++;
     tb_printf(0, y++, 0, 0, "");
 
-    // Print Status bar
-    tb_printf(0, h - 1, 0, TB_BLUE, emptyStr.c_str());
-    if (logsCleaned)
-    {
-        logsCleaned = false;
-        tb_printf(1, h - 1, TB_WHITE, TB_BLUE, "All logs cleaned");
-    }
-    else
-    {
-        tb_printf(1, h - 1, TB_WHITE, TB_BLUE, "%d logs (%.2f %s)", countFiles, sizeFiles, sizeUnity.c_str());
-    }
-    tb_printf(w - 7, h - 1, TB_WHITE, TB_BLUE, "v%s", PROGRAM_VERSION);
-
-    tb_present();
+    drawStatusBar(w, h);
 
     return y;
 }
 
-void countLogFiles()
+void drawStatusBar(int w, int h)
 {
-    countFiles = 0;
-
-    float filesSize = 0;
-    int unityInex = 0;
+    string emptyStr(w, ' ');
+    uint64_t files = logFiles.fileCount();
 
-    for (const auto &entry : filesystem::directory_iterator(logsDir))
+    tb_printf(0, h - 1, 0, TB_BLUE, emptyStr.c_str());
+    if (logsCleaned && files == 0)
+    {
+        tb_printf(1, h - 1, TB_WHITE, TB_BLUE, "All logs cleaned");
+    }
+    else
     {
-        if (entry.is_regular_file() && entry.path().extension() == ".log")
+        double filesSize = logFiles.byteCount();
+        size_t unityIndex = 0;
+
+        while (filesSize >= 1024 && unityIndex < sizeof(sizeUnities) / sizeof(sizeUnities[0]) - 1)
         {
-            int fileSize = filesystem::file_size(entry.path());
-            filesSize += fileSize;
-            countFiles++;
+            filesSize /= 1024;
+            unityIndex++;
         }
-    }
 
-    while (filesSize >= 1024 && unityInex < sizeof(sizeUnities) - 1)
-    {
-        filesSize /= 1024;
-        unityInex++;
+        tb_printf(1, h - 1, TB_WHITE, TB_BLUE, "%llu logs (%.2f %s)", (unsigned long long)files, filesSize, sizeUnities[unityIndex].c_str());
     }
-
-    sizeFiles = filesSize;
-    sizeUnity = sizeUnities[unityInex];
+    tb_printf(w - 7, h - 1, TB_WHITE, TB_BLUE, "v%s", PROGRAM_VERSION);
 }
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "accounting.hpp"
+#include "stats.hpp"
+
+using namespace std;
+
+// Histogram bucket bounds exported to Prometheus, in seconds
+const double METRICS_LATENCY_BOUNDS[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+// Renders a Prometheus text exposition (version 0.0.4) of `stats` plus
+// the log queue and log directory gauges
+string formatMetrics(const StatsSnapshot &stats, size_t queueDepth, uint64_t dropped, LogAccounting &logFiles);
+
+static void appendMetricHeader(string &out, const char *name, const char *type, const char *help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+static void appendMetric(string &out, const char *name, const string &labels, double value)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.12g", value);
+
+    out += name;
+    if (!labels.empty())
+        out += "{" + labels + "}";
+    out += ' ';
+    out += buf;
+    out += '\n';
+}
+
+// Folds the fine-grained latency buckets into the exported bounds. A fine
+// bucket counts towards a bound once its upper limit fits under it.
+static void appendHistogram(string &out, const char *name, const char *help, const vector<uint64_t> &buckets, uint64_t sumMicros)
+{
+    appendMetricHeader(out, name, "histogram", help);
+
+    string bucketName = string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    size_t fine = 0;
+
+    for (double bound : METRICS_LATENCY_BOUNDS)
+    {
+        uint64_t boundMicros = bound * 1000000;
+        while (fine < buckets.size() && latencyBucketLimit(fine) <= boundMicros)
+            cumulative += buckets[fine++];
+
+        char le[32];
+        snprintf(le, sizeof(le), "le=\"%g\"", bound);
+        appendMetric(out, bucketName.c_str(), le, cumulative);
+    }
+
+    uint64_t total = 0;
+    for (uint64_t count : buckets)
+        total += count;
+
+    appendMetric(out, bucketName.c_str(), "le=\"+Inf\"", total);
+    appendMetric(out, (string(name) + "_sum").c_str(), "", sumMicros / 1000000.0);
+    appendMetric(out, (string(name) + "_count").c_str(), "", total);
+}
+
+string formatMetrics(const StatsSnapshot &stats, size_t queueDepth, uint64_t dropped, LogAccounting &logFiles)
+{
+    static const char *classes[] = {"error", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+    string out;
+    out.reserve(8192);
+
+    appendMetricHeader(out, "logduto_requests_total", "counter", "Forwarded requests by method and upstream status class");
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+    {
+        for (int c = 0; c < STATUS_CLASSES; c++)
+        {
+            if (stats.calls[m][c] == 0)
+                continue;
+
+            string labels = string("method=\"") + httpMethodName((HttpMethod)m) + "\",code=\"" + classes[c] + "\"";
+            appendMetric(out, "logduto_requests_total", labels, stats.calls[m][c]);
+        }
+    }
+
+    appendMetricHeader(out, "logduto_requests_rejected_total", "counter", "Requests answered 503 because the workers were saturated");
+    appendMetric(out, "logduto_requests_rejected_total", "", stats.rejected);
+
+    appendMetricHeader(out, "logduto_requests_in_flight", "gauge", "Requests waiting on the upstream");
+    appendMetric(out, "logduto_requests_in_flight", "", stats.inFlight());
+
+    appendHistogram(out, "logduto_upstream_latency_seconds", "Time until the upstream response", stats.latency, stats.latencySum);
+
+    appendMetricHeader(out, "logduto_request_bytes_total", "counter", "Request body bytes forwarded upstream");
+    appendMetric(out, "logduto_request_bytes_total", "", stats.bytesIn);
+
+    appendMetricHeader(out, "logduto_response_bytes_total", "counter", "Response body bytes returned downstream");
+    appendMetric(out, "logduto_response_bytes_total", "", stats.bytesOut);
+
+    appendMetricHeader(out, "logduto_log_queue_depth", "gauge", "Records waiting for a log writer");
+    appendMetric(out, "logduto_log_queue_depth", "", queueDepth);
+
+    appendMetricHeader(out, "logduto_log_records_dropped_total", "counter", "Records dropped by the log backpressure policy");
+    appendMetric(out, "logduto_log_records_dropped_total", "", dropped);
+
+    appendHistogram(out, "logduto_disk_write_seconds", "Time spent writing one record to disk", stats.diskLatency, stats.diskLatencySum);
+
+    appendMetricHeader(out, "logduto_log_files", "gauge", "Request log files in the logs directory by method");
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+    {
+        if (logFiles.fileCount((HttpMethod)m) > 0)
+            appendMetric(out, "logduto_log_files", string("method=\"") + httpMethodName((HttpMethod)m) + "\"", logFiles.fileCount((HttpMethod)m));
+    }
+
+    appendMetricHeader(out, "logduto_log_bytes", "gauge", "Bytes of request log files in the logs directory by method");
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+    {
+        if (logFiles.fileCount((HttpMethod)m) > 0)
+            appendMetric(out, "logduto_log_bytes", string("method=\"") + httpMethodName((HttpMethod)m) + "\"", logFiles.byteCount((HttpMethod)m));
+    }
+
+    return out;
+}
@@ -0,0 +1,177 @@
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "libs/httplib.h"
+
+using namespace std;
+
+// Keeps up to `size` upstream clients alive with keep-alive enabled, so that
+// concurrent workers forward on their own socket instead of serializing on a
+// single shared httplib::Client.
+class ClientPool
+{
+private:
+    struct Slot
+    {
+        unique_ptr<httplib::Client> client;
+        chrono::steady_clock::time_point lastUsed;
+    };
+
+    string url;
+    int timeout;
+    size_t size;
+    chrono::seconds idleTimeout;
+
+    // Idle clients, most recently used at the back
+    vector<Slot> idle;
+    size_t created = 0;
+
+    mutex mtx;
+    condition_variable released;
+
+    unique_ptr<httplib::Client> newClient();
+
+public:
+    class Lease
+    {
+    private:
+        ClientPool *pool;
+        Slot slot;
+        bool healthy = true;
+
+    public:
+        Lease(ClientPool *p, Slot s);
+        Lease(Lease &&other);
+        Lease(const Lease &) = delete;
+        ~Lease();
+
+        httplib::Client &client();
+
+        // Drops the connection instead of returning it to the pool
+        void markFailed();
+    };
+
+    ClientPool(string u, int t, size_t s, int idleSeconds);
+
+    Lease acquire();
+    void release(Slot slot, bool healthy);
+};
+
+ClientPool::ClientPool(string u, int t, size_t s, int idleSeconds)
+{
+    url = u;
+    timeout = t;
+    size = s > 0 ? s : 1;
+    idleTimeout = chrono::seconds(idleSeconds);
+}
+
+unique_ptr<httplib::Client> ClientPool::newClient()
+{
+    auto client = make_unique<httplib::Client>(url);
+
+    client->enable_server_certificate_verification(false);
+    client->set_keep_alive(true);
+    client->set_connection_timeout(timeout, 0);
+    client->set_read_timeout(timeout, 0);
+    client->set_write_timeout(timeout, 0);
+
+    // Targets and bodies are forwarded exactly as received; encoded bodies
+    // are not inflated on the way
+    client->set_url_encode(false);
+    client->set_decompress(false);
+
+    return client;
+}
+
+ClientPool::Lease ClientPool::acquire()
+{
+    vector<Slot> expired;
+    Slot slot;
+
+    {
+        unique_lock<mutex> lock(mtx);
+        released.wait(lock, [&]
+                      { return !idle.empty() || created < size; });
+
+        // Evict connections that sat idle for too long, oldest first
+        auto now = chrono::steady_clock::now();
+        while (!idle.empty() && now - idle.front().lastUsed > idleTimeout)
+        {
+            expired.push_back(move(idle.front()));
+            idle.erase(idle.begin());
+            created--;
+        }
+
+        if (!idle.empty())
+        {
+            slot = move(idle.back());
+            idle.pop_back();
+        }
+        else
+        {
+            created++;
+        }
+    }
+
+    // Expired clients close their sockets here, outside of the lock
+    expired.clear();
+
+    if (!slot.client)
+    {
+        try
+        {
+            slot.client = newClient();
+        }
+        catch (...)
+        {
+            release(Slot(), false);
+            throw;
+        }
+    }
+
+    return Lease(this, move(slot));
+}
+
+void ClientPool::release(Slot slot, bool healthy)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+
+        if (healthy && slot.client)
+        {
+            slot.lastUsed = chrono::steady_clock::now();
+            idle.push_back(move(slot));
+        }
+        else
+        {
+            created--;
+        }
+    }
+
+    released.notify_one();
+}
+
+ClientPool::Lease::Lease(ClientPool *p, Slot s) : pool(p), slot(move(s)) {}
+
+ClientPool::Lease::Lease(Lease &&other) : pool(other.pool), slot(move(other.slot)), healthy(other.healthy)
+{
+    other.pool = nullptr;
+}
+
+ClientPool::Lease::~Lease()
+{
+    if (pool)
+        pool->release(move(slot), healthy);
+}
+
+httplib::Client &ClientPool::Lease::client()
+{
+    return *slot.client;
+}
+
+void ClientPool::Lease::markFailed()
+{
+    healthy = false;
+}
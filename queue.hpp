@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+using namespace std;
+
+// Bounded multi-producer/multi-consumer ring buffer (Vyukov). Producers and
+// consumers never take a lock; a full or empty queue is reported instead of
+// waited on, so callers decide how to apply backpressure.
+template <typename T>
+class BoundedQueue
+{
+private:
+    struct Cell
+    {
+        atomic<size_t> sequence;
+        T data;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+
+    alignas(64) atomic<size_t> enqueuePos{0};
+    alignas(64) atomic<size_t> dequeuePos{0};
+
+public:
+    explicit BoundedQueue(size_t capacity);
+
+    BoundedQueue(const BoundedQueue &) = delete;
+
+    // Moves from `value` only when it returns true
+    bool tryPush(T &&value);
+    bool tryPop(T &value);
+
+    size_t size() const;
+    size_t capacity() const;
+};
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    cells.reset(new Cell[size]);
+    mask = size - 1;
+
+    for (size_t i = 0; i < size; i++)
+        cells[i].sequence.store(i, memory_order_relaxed);
+}
+
+template <typename T>
+bool BoundedQueue<T>::tryPush(T &&value)
+{
+    Cell *cell;
+    size_t pos = enqueuePos.load(memory_order_relaxed);
+
+    while (true)
+    {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = enqueuePos.load(memory_order_relaxed);
+        }
+    }
+
+    cell->data = move(value);
+    cell->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool BoundedQueue<T>::tryPop(T &value)
+{
+    Cell *cell;
+    size_t pos = dequeuePos.load(memory_order_relaxed);
+
+    while (true)
+    {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0)
+        {
+            if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = dequeuePos.load(memory_order_relaxed);
+        }
+    }
+
+    value = move(cell->data);
+    cell->data = T();
+    cell->sequence.store(pos + mask + 1, memory_order_release);
+    return true;
+}
+
+template <typename T>
+size_t BoundedQueue<T>::size() const
+{
+    size_t enq = enqueuePos.load(memory_order_relaxed);
+    size_t deq = dequeuePos.load(memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+}
+
+template <typename T>
+size_t BoundedQueue<T>::capacity() const
+{
+    return mask + 1;
+}
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "history.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+enum class HttpMethod : uint8_t
+{
+    Other,
+    Get,
+    Head,
+    Post,
+    Put,
+    Delete,
+    Options,
+    Patch,
+    Trace,
+    Connect
+};
+
+const int HTTP_METHOD_COUNT = (int)HttpMethod::Connect + 1;
+
+HttpMethod httpMethodFromString(const string &method);
+
+const char *httpMethodName(HttpMethod method);
+
+// Standard reason phrase, empty for unknown codes
+const char *statusReason(int status);
+
+// What a worker publishes about a call; turned into a LogRecord by the
+// thread that owns the history
+struct RecordEvent
+{
+    time_t time = 0;
+    HttpMethod method = HttpMethod::Other;
+    int statusCode = -1;
+    string path;
+    string error;
+    // The method as received, only kept when it is not a standard one
+    string otherMethod;
+    // Reason phrase of the upstream, only kept when it is not the standard one
+    string reason;
+
+    RecordEvent() {}
+    RecordEvent(time_t t, const string &m, string p);
+    RecordEvent(time_t t, const string &m, string p, int s, const string &r);
+    RecordEvent(time_t t, const string &m, string p, string e);
+
+    const char *methodName() const;
+    const char *reasonPhrase() const;
+};
+
+// One JSON object, without a trailing newline
+string formatRecordJson(const RecordEvent &event);
+
+// Compact history entry, path, error, otherMethod and reason are ids into
+// a StringTable
+struct LogRecord
+{
+    int64_t time = 0;
+    uint32_t path = 0;
+    uint32_t error = 0;
+    uint32_t otherMethod = 0;
+    uint32_t reason = 0;
+    int16_t statusCode = -1;
+    HttpMethod method = HttpMethod::Other;
+
+    bool hasError() const;
+};
+
+// Reference counted string interning. Id 0 is always the empty string.
+// Not thread safe.
+class StringTable
+{
+private:
+    struct Slot
+    {
+        const string *text = nullptr;
+        uint32_t refs = 0;
+    };
+
+    unordered_map<string, uint32_t> ids;
+    vector<Slot> slots;
+    vector<uint32_t> freeIds;
+    string emptyStr;
+
+public:
+    StringTable();
+
+    uint32_t intern(const string &text);
+    void release(uint32_t id);
+
+    const string &get(uint32_t id) const;
+    size_t size() const;
+};
+
+// Fixed-capacity record history that interns paths, errors and unusual
+// methods and reasons, releasing them as old records are overwritten
+class RecordHistory
+{
+private:
+    RingHistory<LogRecord> records;
+    StringTable strings;
+
+public:
+    explicit RecordHistory(size_t capacity);
+
+    void push(const RecordEvent &event);
+
+    const LogRecord &at(size_t index) const;
+    const string &text(uint32_t id) const;
+    const char *methodName(const LogRecord &record) const;
+    const char *reasonPhrase(const LogRecord &record) const;
+    size_t size() const;
+};
+
+HttpMethod httpMethodFromString(const string &method)
+{
+    static const unordered_map<string, HttpMethod> methods = {
+        {"GET", HttpMethod::Get},
+        {"HEAD", HttpMethod::Head},
+        {"POST", HttpMethod::Post},
+        {"PUT", HttpMethod::Put},
+        {"DELETE", HttpMethod::Delete},
+        {"OPTIONS", HttpMethod::Options},
+        {"PATCH", HttpMethod::Patch},
+        {"TRACE", HttpMethod::Trace},
+        {"CONNECT", HttpMethod::Connect}};
+
+    auto it = methods.find(method);
+    return it == methods.end() ? HttpMethod::Other : it->second;
+}
+
+const char *httpMethodName(HttpMethod method)
+{
+    static const char *names[] = {"OTHER", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "TRACE", "CONNECT"};
+    return names[(uint8_t)method];
+}
+
+const char *statusReason(int status)
+{
+    switch (status)
+    {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 203: return "Non-Authoritative Information";
+    case 204: return "No Content";
+    case 205: return "Reset Content";
+    case 206: return "Partial Content";
+    case 300: return "Multiple Choices";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 402: return "Payment Required";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 406: return "Not Acceptable";
+    case 407: return "Proxy Authentication Required";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 411: return "Length Required";
+    case 412: return "Precondition Failed";
+    case 413: return "Payload Too Large";
+    case 414: return "URI Too Long";
+    case 415: return "Unsupported Media Type";
+    case 416: return "Range Not Satisfiable";
+    case 417: return "Expectation Failed";
+    case 418: return "I'm a teapot";
+    case 421: return "Misdirected Request";
+    case 422: return "Unprocessable Content";
+    case 425: return "Too Early";
+    case 426: return "Upgrade Required";
+    case 428: return "Precondition Required";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 451: return "Unavailable For Legal Reasons";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+    case 507: return "Insufficient Storage";
+    case 511: return "Network Authentication Required";
+    default: return "";
+    }
+}
+
+RecordEvent::RecordEvent(time_t t, const string &m, string p)
+{
+    time = t;
+    method = httpMethodFromString(m);
+    if (method == HttpMethod::Other)
+        otherMethod = m;
+    path = move(p);
+}
+
+RecordEvent::RecordEvent(time_t t, const string &m, string p, int s, const string &r) : RecordEvent(t, m, move(p))
+{
+    statusCode = s;
+    if (r != statusReason(s))
+        reason = r;
+}
+
+RecordEvent::RecordEvent(time_t t, const string &m, string p, string e) : RecordEvent(t, m, move(p))
+{
+    error = move(e);
+}
+
+const char *RecordEvent::methodName() const
+{
+    return method == HttpMethod::Other ? otherMethod.c_str() : httpMethodName(method);
+}
+
+const char *RecordEvent::reasonPhrase() const
+{
+    return reason.empty() ? statusReason(statusCode) : reason.c_str();
+}
+
+string formatRecordJson(const RecordEvent &event)
+{
+    string json = "{\"time\":\"" + dateStr(event.time) + "T" + timeStr(event.time) + "\"";
+    json += ",\"method\":\"" + jsonEscape(event.methodName()) + "\"";
+    json += ",\"path\":\"" + jsonEscape(event.path) + "\"";
+
+    if (!event.error.empty())
+        json += ",\"error\":\"" + jsonEscape(event.error) + "\"";
+    else if (event.statusCode != -1)
+        json += ",\"status\":" + to_string(event.statusCode) + ",\"reason\":\"" + jsonEscape(event.reasonPhrase()) + "\"";
+
+    json += "}";
+    return json;
+}
+
+bool LogRecord::hasError() const
+{
+    return error != 0;
+}
+
+StringTable::StringTable()
+{
+    slots.push_back(Slot{&emptyStr, 0});
+}
+
+uint32_t StringTable::intern(const string &text)
+{
+    if (text.empty())
+        return 0;
+
+    auto it = ids.find(text);
+    if (it != ids.end())
+    {
+        slots[it->second].refs++;
+        return it->second;
+    }
+
+    uint32_t id;
+    if (!freeIds.empty())
+    {
+        id = freeIds.back();
+        freeIds.pop_back();
+    }
+    else
+    {
+        id = slots.size();
+        slots.emplace_back();
+    }
+
+    // Map keys never move, so slots can point at them
+    auto inserted = ids.emplace(text, id).first;
+    slots[id] = Slot{&inserted->first, 1};
+    return id;
+}
+
+void StringTable::release(uint32_t id)
+{
+    if (id == 0 || id >= slots.size() || slots[id].refs == 0)
+        return;
+
+    if (--slots[id].refs > 0)
+        return;
+
+    ids.erase(*slots[id].text);
+    slots[id].text = nullptr;
+    freeIds.push_back(id);
+}
+
+const string &StringTable::get(uint32_t id) const
+{
+    return id < slots.size() && slots[id].text ? *slots[id].text : emptyStr;
+}
+
+size_t StringTable::size() const
+{
+    return ids.size();
+}
+
+RecordHistory::RecordHistory(size_t capacity) : records(capacity)
+{
+}
+
+void RecordHistory::push(const RecordEvent &event)
+{
+    // The oldest record is about to be overwritten
+    if (records.size() == records.capacity())
+    {
+        const LogRecord &oldest = records.at(0);
+        strings.release(oldest.path);
+        strings.release(oldest.error);
+        strings.release(oldest.otherMethod);
+        strings.release(oldest.reason);
+    }
+
+    LogRecord record;
+    record.time = event.time;
+    record.method = event.method;
+    record.statusCode = event.statusCode;
+    record.path = strings.intern(event.path);
+    record.error = strings.intern(event.error);
+    record.otherMethod = strings.intern(event.otherMethod);
+    record.reason = strings.intern(event.reason);
+
+    records.push(record);
+}
+
+const LogRecord &RecordHistory::at(size_t index) const
+{
+    return records.at(index);
+}
+
+const string &RecordHistory::text(uint32_t id) const
+{
+    return strings.get(id);
+}
+
+const char *RecordHistory::methodName(const LogRecord &record) const
+{
+    return record.method == HttpMethod::Other ? strings.get(record.otherMethod).c_str() : httpMethodName(record.method);
+}
+
+const char *RecordHistory::reasonPhrase(const LogRecord &record) const
+{
+    return record.reason == 0 ? statusReason(record.statusCode) : strings.get(record.reason).c_str();
+}
+
+size_t RecordHistory::size() const
+{
+    return records.size();
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include "accounting.hpp"
+#include "bodystore.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Files removed per pass; passes are spaced so eviction never competes
+// with the log writers for the disk for long
+const size_t RETENTION_BATCH = 256;
+const int RETENTION_PAUSE_MS = 50;
+const int RETENTION_INTERVAL_MS = 1000;
+
+// Zero leaves a limit off
+struct RetentionLimits
+{
+    uint64_t bytes = 0;
+    // Milliseconds
+    int64_t age = 0;
+    uint64_t files = 0;
+
+    bool enabled() const;
+};
+
+// Evicts request logs and data blobs oldest first, on its own thread, once
+// the logs directory passes a limit. Logs come from `accounting`, which
+// must track files; blobs from `bodies` when given. Data dumps go with the
+// blob they point at.
+class LogRetention
+{
+private:
+    RetentionLimits limits;
+    string logsDir;
+    LogAccounting &accounting;
+    BodyStore *bodies;
+
+    thread worker;
+    mutex mtx;
+    condition_variable wake;
+    bool stopping = false;
+
+    atomic<uint64_t> evicted{0};
+
+    void run();
+    size_t evictBatch();
+
+public:
+    LogRetention(RetentionLimits l, string dir, LogAccounting &a, BodyStore *b);
+    LogRetention(const LogRetention &) = delete;
+    ~LogRetention();
+
+    void stop();
+
+    // Log files and blobs removed so far
+    uint64_t evictedCount();
+};
+
+bool RetentionLimits::enabled() const
+{
+    return bytes > 0 || age > 0 || files > 0;
+}
+
+LogRetention::LogRetention(RetentionLimits l, string dir, LogAccounting &a, BodyStore *b) : limits(l), logsDir(dir), accounting(a), bodies(b)
+{
+    worker = thread([this]
+                    { run(); });
+}
+
+LogRetention::~LogRetention()
+{
+    stop();
+}
+
+void LogRetention::run()
+{
+    if (bodies)
+        bodies->scan();
+
+    while (true)
+    {
+        size_t removed = evictBatch();
+
+        unique_lock<mutex> lock(mtx);
+        auto wait = chrono::milliseconds(removed >= RETENTION_BATCH ? RETENTION_PAUSE_MS : RETENTION_INTERVAL_MS);
+        wake.wait_for(lock, wait, [this]
+                      { return stopping; });
+        if (stopping)
+            break;
+    }
+}
+
+// Whichever of the oldest log and the least recently used blob is older
+// goes first. A blob is used by every log that refers to it, so it
+// outlives them.
+size_t LogRetention::evictBatch()
+{
+    int64_t now = nowMillis();
+    size_t removed = 0;
+
+    while (removed < RETENTION_BATCH)
+    {
+        int64_t logTime = accounting.oldestTime();
+
+        string digest;
+        int64_t blobTime = 0;
+        bool hasBlob = bodies && bodies->oldest(digest, blobTime);
+
+        if (logTime == 0 && !hasBlob)
+            break;
+
+        bool blobFirst = hasBlob && (logTime == 0 || blobTime < logTime);
+        int64_t oldest = blobFirst ? blobTime : logTime;
+
+        uint64_t total = accounting.byteCount() + (bodies ? bodies->storedBytes() : 0);
+        bool tooOld = limits.age > 0 && oldest < now - limits.age;
+        bool tooBig = limits.bytes > 0 && total > limits.bytes;
+        bool tooMany = limits.files > 0 && accounting.fileCount() > limits.files;
+
+        if (blobFirst && (tooOld || tooBig))
+        {
+            bodies->evict(digest);
+        }
+        else if (logTime != 0 && (tooOld || tooBig || tooMany))
+        {
+            LogFileEntry entry;
+            if (!accounting.popOldest(entry))
+                break;
+            ::unlink(entry.path.c_str());
+
+            // Shards of a sharded layout go once emptied
+            removeEmptyDirs(filesystem::path(entry.path).parent_path(), logsDir);
+        }
+        else
+        {
+            break;
+        }
+
+        removed++;
+        evicted++;
+    }
+
+    return removed;
+}
+
+void LogRetention::stop()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (stopping)
+            return;
+        stopping = true;
+    }
+
+    wake.notify_all();
+    worker.join();
+}
+
+uint64_t LogRetention::evictedCount()
+{
+    return evicted;
+}
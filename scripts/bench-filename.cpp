@@ -0,0 +1,46 @@
+// Per-request cost of naming a log file: the regex replacements saveToFile
+// used to run against buildLogFileName and readableDate.
+//
+// g++ -O2 -std=c++17 -o build/bench-filename scripts/bench-filename.cpp
+// ./build/bench-filename
+
+#include <chrono>
+#include <iostream>
+#include <regex>
+#include "../filename.hpp"
+#include "../util.hpp"
+
+using namespace std;
+
+const int ITERATIONS = 200000;
+
+int main()
+{
+    string dir = "./logs", method = "GET", path = "/api/v1/users/123/orders";
+    volatile size_t sink = 0;
+
+    auto started = chrono::steady_clock::now();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        time_t now = time(0);
+        string date = ctime(&now);
+        date = regex_replace(date, regex("  "), " ");
+        string name = dir + "/" + method + regex_replace(path, regex("/"), "_") + "_" + dateStr(now) + "_" + timeStr(now) + ".log";
+        sink += name.size() + date.size();
+    }
+    auto regexDone = chrono::steady_clock::now();
+
+    string name;
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        time_t now = time(0);
+        buildLogFileName(name, dir, LogLayout::Flat, method, path, now, 0, ".log");
+        string date = readableDate(now);
+        sink += name.size() + date.size();
+    }
+    auto builderDone = chrono::steady_clock::now();
+
+    cout << "regex:   " << chrono::duration<double, nano>(regexDone - started).count() / ITERATIONS << " ns/request" << endl;
+    cout << "builder: " << chrono::duration<double, nano>(builderDone - regexDone).count() / ITERATIONS << " ns/request" << endl;
+    return 0;
+}
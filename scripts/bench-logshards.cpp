@@ -0,0 +1,105 @@
+// Cost of each --log-layout with a million request logs: creating them the
+// way Logduto does (O_CREAT | O_EXCL, shards made on ENOENT), statting
+// them back by name, the forEachLogFile scan behind the accounting seed,
+// and --clean. The logs are spread over one day.
+//
+// g++ -O2 -std=c++17 -o build/bench-logshards scripts/bench-logshards.cpp
+// ./build/bench-logshards [files] [directory]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../filename.hpp"
+#include "../files.hpp"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+const time_t SPREAD_SECONDS = 86400;
+const size_t LOOKUPS = 100000;
+
+double secondsSince(Clock::time_point started)
+{
+    return chrono::duration<double>(Clock::now() - started).count();
+}
+
+void run(const char *name, LogLayout layout, const string &dir, size_t count)
+{
+    filesystem::remove_all(dir);
+    filesystem::create_directories(dir);
+
+    time_t start = time(0) - SPREAD_SECONDS;
+    string path;
+
+    // The last tenth shows how creates slow down as directories fill
+    auto started = Clock::now();
+    auto lastTenth = started;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i == count - count / 10)
+            lastTenth = Clock::now();
+
+        buildLogFileName(path, dir, layout, "GET", "/api/v1/items/" + to_string(i), start + (time_t)(i * SPREAD_SECONDS / count), 0, ".log");
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0 && errno == ENOENT)
+        {
+            filesystem::create_directories(filesystem::path(path).parent_path());
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        }
+        if (fd < 0)
+        {
+            perror(path.c_str());
+            exit(1);
+        }
+        ::close(fd);
+    }
+    double created = secondsSince(started);
+    double lastCreated = secondsSince(lastTenth);
+
+    mt19937_64 pick(42);
+    struct stat st;
+    started = Clock::now();
+    for (size_t i = 0; i < LOOKUPS; i++)
+    {
+        size_t n = pick() % count;
+        buildLogFileName(path, dir, layout, "GET", "/api/v1/items/" + to_string(n), start + (time_t)(n * SPREAD_SECONDS / count), 0, ".log");
+        if (::stat(path.c_str(), &st) != 0)
+        {
+            perror(path.c_str());
+            exit(1);
+        }
+    }
+    double looked = secondsSince(started);
+
+    size_t found = 0;
+    started = Clock::now();
+    forEachLogFile(dir, layout, [&](const filesystem::path &)
+                   { found++; });
+    double scanned = secondsSince(started);
+
+    started = Clock::now();
+    cleanLogFiles(dir, layout);
+    double cleaned = secondsSince(started);
+    filesystem::remove_all(dir);
+
+    printf("%-5s create %7.0f/s (last tenth %7.0f/s)  stat %7.0f/s  scan %5.2fs (%zu)  clean %6.2fs\n", name, count / created,
+           (count / 10) / lastCreated, LOOKUPS / looked, scanned, found, cleaned);
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    string dir = argc > 2 ? argv[2] : "./bench-logshards";
+
+    run("flat", LogLayout::Flat, dir + "/flat", count);
+    run("hour", LogLayout::Hour, dir + "/hour", count);
+    run("hash", LogLayout::Hash, dir + "/hash", count);
+    return 0;
+}
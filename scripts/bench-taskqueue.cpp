@@ -0,0 +1,96 @@
+// Accept-to-dispatch latency of the server task queues: httplib's
+// ThreadPool, BoundedTaskQueue's shared queue (the default) and its
+// per-worker deques (--work-stealing). One thread enqueues like the accept
+// thread, each task records how long it waited for a worker.
+//
+// g++ -O2 -std=c++17 -pthread -o build/bench-taskqueue scripts/bench-taskqueue.cpp
+// ./build/bench-taskqueue [workers]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "../taskqueue.hpp"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+const size_t FLAT_OUT_TASKS = 400000;
+const size_t PACED_TASKS = 50000;
+
+void spin(int micros)
+{
+    auto until = Clock::now() + chrono::microseconds(micros);
+    while (Clock::now() < until)
+    {
+    }
+}
+
+// Enqueues `count` tasks `gapUs` apart, 0 for as fast as possible, each
+// busy for `workUs`
+void run(const char *name, httplib::TaskQueue &queue, size_t count, int gapUs, int workUs)
+{
+    vector<int64_t> waited(count);
+    atomic<size_t> done{0};
+
+    auto started = Clock::now();
+    auto next = started;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (gapUs > 0)
+        {
+            next += chrono::microseconds(gapUs);
+            while (Clock::now() < next)
+            {
+            }
+        }
+
+        auto accepted = Clock::now();
+        while (!queue.enqueue([&, i, accepted]
+                              {
+            waited[i] = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - accepted).count();
+            spin(workUs);
+            done++; }))
+        {
+        }
+    }
+
+    while (done < count)
+        this_thread::yield();
+    double seconds = chrono::duration<double>(Clock::now() - started).count();
+    queue.shutdown();
+
+    sort(waited.begin(), waited.end());
+    printf("%-14s gap %2dus work %2dus  %8.0f tasks/s  p50 %7.1fus  p99 %8.1fus\n", name, gapUs, workUs, count / seconds,
+           waited[count / 2] / 1000.0, waited[count * 99 / 100] / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t workers = argc > 1 ? strtoul(argv[1], nullptr, 10) : 8;
+    printf("%zu workers, %u CPUs\n", workers, thread::hardware_concurrency());
+
+    for (int gapUs : {0, 20})
+    {
+        for (int workUs : {0, 5})
+        {
+            size_t count = gapUs > 0 ? PACED_TASKS : FLAT_OUT_TASKS;
+            {
+                httplib::ThreadPool queue(workers);
+                run("ThreadPool", queue, count, gapUs, workUs);
+            }
+            {
+                BoundedTaskQueue queue(workers, 0, false);
+                run("shared", queue, count, gapUs, workUs);
+            }
+            {
+                BoundedTaskQueue queue(workers, 0, true);
+                run("work stealing", queue, count, gapUs, workUs);
+            }
+        }
+    }
+    return 0;
+}
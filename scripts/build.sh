@@ -41,10 +41,10 @@ if [ "$1" = "-r" ]; then
         g++ -O3 -std=c++17 \
             -o build/release/bin/$program_name \
             build/release/lib/*.o \
-            -lssl -lcrypto -framework CoreFoundation -framework Security
+            -lssl -lcrypto -lz -framework CoreFoundation -framework Security
     else
         # Copy static libs
-        cp -L /usr/lib/x86_64-linux-gnu/{libssl,libcrypto}.a build/release/lib
+        cp -L /usr/lib/x86_64-linux-gnu/{libssl,libcrypto,libz}.a build/release/lib
 
         if [ $? -ne 0 ]; then
             echo "Failed to copy static libs"; exit 1
@@ -53,7 +53,7 @@ if [ "$1" = "-r" ]; then
         g++ -O3 -std=c++17 -static-libgcc -static-libstdc++ \
             -pthread \
             build/release/lib/*.o \
-            -L build/release/lib -l:libssl.a -l:libcrypto.a -ldl \
+            -L build/release/lib -l:libssl.a -l:libcrypto.a -l:libz.a -ldl \
             -o build/release/bin/$program_name
     fi
 
@@ -80,13 +80,13 @@ elif [ "$1" = "-d" ]; then
         g++ -g -std=c++17 \
             -o build/debug/bin/$program_name \
             build/debug/lib/*.o \
-            -lssl -lcrypto -framework CoreFoundation -framework Security
+            -lssl -lcrypto -lz -framework CoreFoundation -framework Security
     else
         g++ -g -std=c++17 \
             -pthread \
             -o build/debug/bin/$program_name \
             build/debug/lib/*.o \
-            -lssl -lcrypto
+            -lssl -lcrypto -lz
     fi
 else
     echo "Usage: $0 [-r] [-d]"
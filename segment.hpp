@@ -0,0 +1,485 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "compress.hpp"
+#include "logduto.hpp"
+
+using namespace std;
+
+// Segment log layout, all integers in host byte order:
+//
+//   segments/NNNNNNNN.seg  records appended back to back, each one
+//                          u32 length (whole record), u32 magic,
+//                          u64 sequence, i64 timestamp (ms), u32 latency (us),
+//                          i16 status, u16 flags, then method, path,
+//                          request headers, request body, response headers,
+//                          response body and both content types, each as
+//                          u32 length + bytes. The flags tell which bodies
+//                          are stored gzip compressed.
+//   segments/index         one SegmentIndexEntry per record, entry N
+//                          describing sequence N
+
+const uint32_t SEGMENT_RECORD_MAGIC = 0x3152444c; // "LDR1"
+
+const uint16_t SEGMENT_GZIP_REQUEST_BODY = 1;
+const uint16_t SEGMENT_GZIP_RESPONSE_BODY = 2;
+
+// Shorter bodies are stored as they are
+const size_t SEGMENT_COMPRESS_MIN_BYTES = 128;
+
+struct SegmentIndexEntry
+{
+    uint64_t sequence;
+    // Commit time in ms, never decreasing so ranges can be binary searched
+    int64_t timestamp;
+    uint64_t offset;
+    uint32_t segment;
+    uint32_t length;
+    uint32_t latency;
+    int16_t status;
+    uint16_t flags;
+    // Offsets of the body fields relative to the record start
+    uint32_t reqBodyOffset;
+    uint32_t resBodyOffset;
+};
+
+static_assert(sizeof(SegmentIndexEntry) == 48, "Index entries must stay fixed width");
+
+struct SegmentRecord
+{
+    uint64_t sequence = 0;
+    int64_t timestamp = 0;
+    uint32_t latency = 0;
+    int status = 0;
+    string method;
+    string path;
+    string reqHeaders;
+    string reqBody;
+    string resHeaders;
+    string resBody;
+    string reqContentType;
+    string resContentType;
+};
+
+string segmentsDir(string logsDir);
+
+string segmentFilePath(string dir, uint32_t segment);
+
+// Appends Logduto records to segment files and the index. Safe to share
+// between writer threads.
+class SegmentStore
+{
+private:
+    string dir;
+    size_t segmentBytes;
+    bool compressBodies;
+
+    int indexFd = -1;
+    int segmentFd = -1;
+    uint32_t segment = 0;
+    uint64_t segmentSize = 0;
+    uint64_t nextSequence = 0;
+    int64_t lastTimestamp = 0;
+
+    mutex mtx;
+
+    void recover();
+    void openSegment(uint32_t id, bool truncate);
+
+public:
+    SegmentStore(string logsDir, size_t bytes, bool compress);
+    SegmentStore(const SegmentStore &) = delete;
+    ~SegmentStore();
+
+    void append(Logduto &logduto);
+
+    // Flushes the current segment and the index to disk
+    void sync();
+};
+
+// Read-only view of a segment log through a memory-mapped index
+class SegmentReader
+{
+private:
+    string dir;
+    const SegmentIndexEntry *entries = nullptr;
+    size_t count = 0;
+    size_t mappedBytes = 0;
+
+public:
+    explicit SegmentReader(string logsDir);
+    SegmentReader(const SegmentReader &) = delete;
+    ~SegmentReader();
+
+    size_t size();
+
+    // O(1) lookup, nullptr when the sequence was never written
+    const SegmentIndexEntry *entry(uint64_t sequence);
+
+    // First sequence committed at or after `timestamp`
+    uint64_t lowerBound(int64_t timestamp);
+
+    bool read(const SegmentIndexEntry &entry, SegmentRecord &record);
+};
+
+string segmentsDir(string logsDir)
+{
+    return logsDir + "/segments";
+}
+
+string segmentFilePath(string dir, uint32_t segment)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "%08u.seg", segment);
+    return dir + "/" + name;
+}
+
+static void putField(string &buf, const string &value)
+{
+    uint32_t length = value.size();
+    buf.append((const char *)&length, sizeof(length));
+    buf.append(value);
+}
+
+template <typename T>
+static void putValue(string &buf, T value)
+{
+    buf.append((const char *)&value, sizeof(value));
+}
+
+static bool writeAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = ::write(fd, data, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+SegmentStore::SegmentStore(string logsDir, size_t bytes, bool compress)
+{
+    dir = segmentsDir(logsDir);
+    segmentBytes = bytes;
+    compressBodies = compress;
+
+    filesystem::create_directories(dir);
+
+    indexFd = ::open((dir + "/index").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (indexFd < 0)
+        throw runtime_error("Failed to open segment index in " + dir + "\n");
+
+    recover();
+}
+
+SegmentStore::~SegmentStore()
+{
+    if (segmentFd >= 0)
+        ::close(segmentFd);
+    if (indexFd >= 0)
+        ::close(indexFd);
+}
+
+// Drops a partially written tail left behind by a crash, so the index and
+// the segments agree on the last record
+void SegmentStore::recover()
+{
+    struct stat st;
+    if (fstat(indexFd, &st) != 0)
+        throw runtime_error("Failed to stat segment index in " + dir + "\n");
+
+    size_t entries = st.st_size / sizeof(SegmentIndexEntry);
+    if (ftruncate(indexFd, entries * sizeof(SegmentIndexEntry)) != 0)
+        throw runtime_error("Failed to truncate segment index in " + dir + "\n");
+
+    uint64_t end = 0;
+
+    if (entries > 0)
+    {
+        SegmentIndexEntry last;
+        if (pread(indexFd, &last, sizeof(last), (entries - 1) * sizeof(SegmentIndexEntry)) != (ssize_t)sizeof(last))
+            throw runtime_error("Failed to read segment index in " + dir + "\n");
+
+        segment = last.segment;
+        end = last.offset + last.length;
+        nextSequence = last.sequence + 1;
+        lastTimestamp = last.timestamp;
+    }
+
+    string path = segmentFilePath(dir, segment);
+    if (filesystem::exists(path))
+        filesystem::resize_file(path, end);
+
+    openSegment(segment, false);
+}
+
+void SegmentStore::openSegment(uint32_t id, bool truncate)
+{
+    if (segmentFd >= 0)
+        ::close(segmentFd);
+
+    segment = id;
+    segmentFd = ::open(segmentFilePath(dir, id).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (segmentFd < 0)
+        throw runtime_error("Failed to open segment " + segmentFilePath(dir, id) + "\n");
+
+    struct stat st;
+    segmentSize = fstat(segmentFd, &st) == 0 ? st.st_size : 0;
+}
+
+void SegmentStore::append(Logduto &logduto)
+{
+    ReqData &req = logduto.getReqData();
+    ResData &res = logduto.getResData();
+
+    // Bodies that arrived gzip encoded are kept as they are
+    uint16_t flags = 0;
+    string reqBody, resBody;
+    const string *reqField = &req.getBody();
+    const string *resField = &res.getBody();
+
+    if (compressBodies && reqField->size() >= SEGMENT_COMPRESS_MIN_BYTES && !isGzipped(*reqField) &&
+        gzipCompress(reqField->data(), reqField->size(), reqBody))
+    {
+        flags |= SEGMENT_GZIP_REQUEST_BODY;
+        reqField = &reqBody;
+    }
+
+    if (compressBodies && resField->size() >= SEGMENT_COMPRESS_MIN_BYTES && !isGzipped(*resField) &&
+        gzipCompress(resField->data(), resField->size(), resBody))
+    {
+        flags |= SEGMENT_GZIP_RESPONSE_BODY;
+        resField = &resBody;
+    }
+
+    // Encode outside the lock, the sequence is patched in once assigned
+    string buf;
+    buf.reserve(64 + req.getHeaders().size() + reqField->size() + res.getHeaders().size() + resField->size());
+
+    putValue<uint32_t>(buf, 0);
+    putValue<uint32_t>(buf, SEGMENT_RECORD_MAGIC);
+    putValue<uint64_t>(buf, 0);
+    putValue<int64_t>(buf, logduto.getCreatedMs());
+    putValue<uint32_t>(buf, logduto.getLatency());
+    putValue<int16_t>(buf, res.getStatus());
+    putValue<uint16_t>(buf, flags);
+    putField(buf, logduto.getMethod());
+    putField(buf, logduto.getPath());
+    putField(buf, req.getHeaders());
+    uint32_t reqBodyOffset = buf.size() + sizeof(uint32_t);
+    putField(buf, *reqField);
+    putField(buf, res.getHeaders());
+    uint32_t resBodyOffset = buf.size() + sizeof(uint32_t);
+    putField(buf, *resField);
+    putField(buf, req.getContentType());
+    putField(buf, res.getContentType());
+
+    uint32_t length = buf.size();
+    memcpy(&buf[0], &length, sizeof(length));
+
+    lock_guard<mutex> lock(mtx);
+
+    if (segmentSize > 0 && segmentSize + length > segmentBytes)
+    {
+        try
+        {
+            openSegment(segment + 1, true);
+        }
+        catch (const exception &e)
+        {
+            cerr << e.what();
+            return;
+        }
+    }
+
+    SegmentIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.sequence = nextSequence;
+    entry.timestamp = max(lastTimestamp, logduto.getCreatedMs());
+    entry.offset = segmentSize;
+    entry.segment = segment;
+    entry.length = length;
+    entry.latency = logduto.getLatency();
+    entry.status = res.getStatus();
+    entry.flags = flags;
+    entry.reqBodyOffset = reqBodyOffset;
+    entry.resBodyOffset = resBodyOffset;
+
+    memcpy(&buf[8], &entry.sequence, sizeof(entry.sequence));
+
+    // The index entry goes last: a record is only visible once fully written.
+    // Partial writes are cut off again, so later records still line up.
+    if (!writeAll(segmentFd, buf.data(), buf.size()))
+    {
+        cerr << "Failed to write segment " << segmentFilePath(dir, segment) << endl;
+        if (ftruncate(segmentFd, segmentSize) != 0)
+            cerr << "Failed to truncate segment " << segmentFilePath(dir, segment) << endl;
+        return;
+    }
+
+    if (!writeAll(indexFd, (const char *)&entry, sizeof(entry)))
+    {
+        cerr << "Failed to write segment index" << endl;
+        struct stat st;
+        if (fstat(indexFd, &st) != 0 || ftruncate(indexFd, st.st_size - st.st_size % sizeof(SegmentIndexEntry)) != 0)
+            cerr << "Failed to truncate segment index" << endl;
+        if (ftruncate(segmentFd, segmentSize) != 0)
+            cerr << "Failed to truncate segment " << segmentFilePath(dir, segment) << endl;
+        return;
+    }
+    segmentSize += length;
+
+    nextSequence++;
+    lastTimestamp = entry.timestamp;
+}
+
+void SegmentStore::sync()
+{
+    lock_guard<mutex> lock(mtx);
+
+    if (segmentFd >= 0)
+        fsync(segmentFd);
+    if (indexFd >= 0)
+        fsync(indexFd);
+}
+
+SegmentReader::SegmentReader(string logsDir)
+{
+    dir = segmentsDir(logsDir);
+
+    int fd = ::open((dir + "/index").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw runtime_error("No segment index in " + dir + "\n");
+
+    struct stat st;
+    fstat(fd, &st);
+    count = st.st_size / sizeof(SegmentIndexEntry);
+    mappedBytes = count * sizeof(SegmentIndexEntry);
+
+    if (mappedBytes > 0)
+    {
+        void *addr = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            ::close(fd);
+            throw runtime_error("Failed to map segment index\n");
+        }
+        entries = (const SegmentIndexEntry *)addr;
+    }
+
+    ::close(fd);
+}
+
+SegmentReader::~SegmentReader()
+{
+    if (entries)
+        munmap((void *)entries, mappedBytes);
+}
+
+size_t SegmentReader::size()
+{
+    return count;
+}
+
+const SegmentIndexEntry *SegmentReader::entry(uint64_t sequence)
+{
+    if (count == 0 || sequence < entries[0].sequence)
+        return nullptr;
+
+    uint64_t position = sequence - entries[0].sequence;
+    return position < count ? &entries[position] : nullptr;
+}
+
+uint64_t SegmentReader::lowerBound(int64_t timestamp)
+{
+    size_t low = 0, high = count;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (entries[middle].timestamp < timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return count == 0 ? 0 : entries[0].sequence + low;
+}
+
+bool SegmentReader::read(const SegmentIndexEntry &entry, SegmentRecord &record)
+{
+    int fd = ::open(segmentFilePath(dir, entry.segment).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    string buf(entry.length, '\0');
+    ssize_t n = pread(fd, &buf[0], entry.length, entry.offset);
+    ::close(fd);
+
+    if (n != (ssize_t)entry.length)
+        return false;
+
+    size_t pos = 0;
+    auto getValue = [&](auto &value)
+    {
+        if (pos + sizeof(value) > buf.size())
+            return false;
+        memcpy(&value, buf.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    };
+    auto getField = [&](string &value)
+    {
+        uint32_t length;
+        if (!getValue(length) || pos + length > buf.size())
+            return false;
+        value.assign(buf.data() + pos, length);
+        pos += length;
+        return true;
+    };
+
+    uint32_t length, magic, latency;
+    int16_t status;
+    uint16_t flags;
+
+    bool ok = getValue(length) && getValue(magic) && magic == SEGMENT_RECORD_MAGIC &&
+              getValue(record.sequence) && getValue(record.timestamp) &&
+              getValue(latency) && getValue(status) && getValue(flags) &&
+              getField(record.method) && getField(record.path) &&
+              getField(record.reqHeaders) && getField(record.reqBody) &&
+              getField(record.resHeaders) && getField(record.resBody) &&
+              getField(record.reqContentType) && getField(record.resContentType);
+
+    record.latency = latency;
+    record.status = status;
+
+    if (ok && (flags & SEGMENT_GZIP_REQUEST_BODY))
+    {
+        string body;
+        ok = gzipDecompress(record.reqBody.data(), record.reqBody.size(), body);
+        record.reqBody = move(body);
+    }
+
+    if (ok && (flags & SEGMENT_GZIP_RESPONSE_BODY))
+    {
+        string body;
+        ok = gzipDecompress(record.resBody.data(), record.resBody.size(), body);
+        record.resBody = move(body);
+    }
+
+    return ok;
+}
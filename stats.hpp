@@ -0,0 +1,337 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "record.hpp"
+
+using namespace std;
+
+// Log-linear latency buckets in microseconds: every power of two is split
+// into LATENCY_SUB_BUCKETS steps, so a bucket is at most ~6% wide
+const int LATENCY_SUB_BITS = 4;
+const int LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BITS;
+const int LATENCY_BUCKETS = (33 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS;
+
+// Calls are counted by status class: 0 for transport errors, 1 to 5 for
+// 1xx to 5xx
+const int STATUS_CLASSES = 6;
+
+int statusClass(int status);
+
+size_t latencyBucket(uint32_t micros);
+
+// Upper bound of a bucket in microseconds
+uint64_t latencyBucketLimit(size_t bucket);
+
+// e.g. "850us", "12.3ms", "1.20s", "-" when nothing was recorded
+string formatLatency(uint64_t micros);
+
+// Counters owned by a single thread. Only the owner writes them, relaxed
+// atomics let the renderer read them without locking.
+struct alignas(64) StatsShard
+{
+    atomic<uint64_t> started{0};
+    atomic<uint64_t> completed{0};
+    atomic<uint64_t> errors{0};
+    atomic<uint64_t> rejected{0};
+    atomic<uint64_t> calls[HTTP_METHOD_COUNT][STATUS_CLASSES];
+    atomic<uint64_t> latency[LATENCY_BUCKETS];
+    atomic<uint64_t> latencySum{0};
+    atomic<uint64_t> bytesIn{0};
+    atomic<uint64_t> bytesOut{0};
+    atomic<uint64_t> diskLatency[LATENCY_BUCKETS];
+    atomic<uint64_t> diskLatencySum{0};
+
+    // Cleared when the owning thread exits so another one can take over
+    atomic<bool> claimed{true};
+
+    StatsShard();
+};
+
+struct StatsSnapshot
+{
+    uint64_t started = 0;
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    uint64_t rejected = 0;
+    uint64_t calls[HTTP_METHOD_COUNT][STATUS_CLASSES] = {};
+    vector<uint64_t> latency = vector<uint64_t>(LATENCY_BUCKETS, 0);
+    uint64_t latencySum = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    vector<uint64_t> diskLatency = vector<uint64_t>(LATENCY_BUCKETS, 0);
+    uint64_t diskLatencySum = 0;
+
+    uint64_t inFlight() const;
+
+    // Upstream latency in microseconds at quantile q (0..1)
+    uint64_t percentile(double q) const;
+
+    // Counts accumulated since an earlier snapshot
+    StatsSnapshot since(const StatsSnapshot &earlier) const;
+};
+
+// Request statistics fed by the server workers. Each thread counts into its
+// own shard; snapshot() merges them.
+class Stats
+{
+private:
+    vector<shared_ptr<StatsShard>> shards;
+    mutex mtx;
+
+    StatsShard &local();
+
+public:
+    Stats() {}
+    Stats(const Stats &) = delete;
+
+    void begin();
+
+    // Status 0 or less marks a call that never got a response
+    void end(HttpMethod method, int status, uint32_t latencyMicros);
+
+    // A request answered 503 because the workers were saturated
+    void reject();
+
+    void addBytes(uint64_t in, uint64_t out);
+    void diskWrite(uint32_t latencyMicros);
+
+    StatsSnapshot snapshot();
+};
+
+int statusClass(int status)
+{
+    return status >= 100 && status < 600 ? status / 100 : 0;
+}
+
+static void bump(atomic<uint64_t> &counter, uint64_t by = 1)
+{
+    counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
+}
+
+size_t latencyBucket(uint32_t micros)
+{
+    if (micros < LATENCY_SUB_BUCKETS)
+        return micros;
+
+    int exponent = 31 - __builtin_clz(micros);
+    int shift = exponent - LATENCY_SUB_BITS;
+    size_t sub = (micros >> shift) & (LATENCY_SUB_BUCKETS - 1);
+
+    return (shift + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+uint64_t latencyBucketLimit(size_t bucket)
+{
+    if (bucket < (size_t)LATENCY_SUB_BUCKETS)
+        return bucket + 1;
+
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+
+    return (uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) << shift;
+}
+
+string formatLatency(uint64_t micros)
+{
+    char buf[32];
+
+    if (micros == 0)
+        return "-";
+    if (micros < 1000)
+        snprintf(buf, sizeof(buf), "%lluus", (unsigned long long)micros);
+    else if (micros < 1000000)
+        snprintf(buf, sizeof(buf), "%.1fms", micros / 1000.0);
+    else
+        snprintf(buf, sizeof(buf), "%.2fs", micros / 1000000.0);
+
+    return buf;
+}
+
+StatsShard::StatsShard()
+{
+    for (auto &method : calls)
+        for (auto &count : method)
+            count.store(0, memory_order_relaxed);
+
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        latency[i].store(0, memory_order_relaxed);
+        diskLatency[i].store(0, memory_order_relaxed);
+    }
+}
+
+uint64_t StatsSnapshot::inFlight() const
+{
+    return started > completed ? started - completed : 0;
+}
+
+uint64_t StatsSnapshot::percentile(double q) const
+{
+    uint64_t total = 0;
+    for (uint64_t count : latency)
+        total += count;
+
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < latency.size(); i++)
+    {
+        seen += latency[i];
+        if (seen > rank)
+            return latencyBucketLimit(i);
+    }
+
+    return latencyBucketLimit(latency.size() - 1);
+}
+
+StatsSnapshot StatsSnapshot::since(const StatsSnapshot &earlier) const
+{
+    StatsSnapshot delta;
+    delta.started = started - earlier.started;
+    delta.completed = completed - earlier.completed;
+    delta.errors = errors - earlier.errors;
+    delta.rejected = rejected - earlier.rejected;
+    delta.latencySum = latencySum - earlier.latencySum;
+    delta.bytesIn = bytesIn - earlier.bytesIn;
+    delta.bytesOut = bytesOut - earlier.bytesOut;
+    delta.diskLatencySum = diskLatencySum - earlier.diskLatencySum;
+
+    for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+        for (int c = 0; c < STATUS_CLASSES; c++)
+            delta.calls[m][c] = calls[m][c] - earlier.calls[m][c];
+
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        delta.latency[i] = latency[i] - earlier.latency[i];
+        delta.diskLatency[i] = diskLatency[i] - earlier.diskLatency[i];
+    }
+
+    return delta;
+}
+
+StatsShard &Stats::local()
+{
+    // Releases the shard when the thread exits so short-lived threads do
+    // not grow the list; the shared pointer keeps it valid either way
+    struct Holder
+    {
+        const Stats *owner = nullptr;
+        shared_ptr<StatsShard> shard;
+
+        ~Holder()
+        {
+            if (shard)
+                shard->claimed.store(false, memory_order_release);
+        }
+    };
+
+    thread_local Holder holder;
+
+    if (holder.owner != this)
+    {
+        if (holder.shard)
+            holder.shard->claimed.store(false, memory_order_release);
+
+        lock_guard<mutex> lock(mtx);
+
+        holder.shard = nullptr;
+        for (auto &shard : shards)
+        {
+            bool expected = false;
+            if (shard->claimed.compare_exchange_strong(expected, true, memory_order_acquire))
+            {
+                holder.shard = shard;
+                break;
+            }
+        }
+
+        if (!holder.shard)
+        {
+            shards.push_back(make_shared<StatsShard>());
+            holder.shard = shards.back();
+        }
+        holder.owner = this;
+    }
+
+    return *holder.shard;
+}
+
+void Stats::begin()
+{
+    bump(local().started);
+}
+
+void Stats::end(HttpMethod method, int status, uint32_t latencyMicros)
+{
+    StatsShard &shard = local();
+
+    bump(shard.calls[(int)method][statusClass(status)]);
+    bump(shard.latency[latencyBucket(latencyMicros)]);
+    bump(shard.latencySum, latencyMicros);
+
+    if (status <= 0 || status >= 500)
+        bump(shard.errors);
+
+    // Completed last, so a snapshot never sees more completions than starts
+    shard.completed.store(shard.completed.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+void Stats::reject()
+{
+    bump(local().rejected);
+}
+
+void Stats::addBytes(uint64_t in, uint64_t out)
+{
+    StatsShard &shard = local();
+    bump(shard.bytesIn, in);
+    bump(shard.bytesOut, out);
+}
+
+void Stats::diskWrite(uint32_t latencyMicros)
+{
+    StatsShard &shard = local();
+    bump(shard.diskLatency[latencyBucket(latencyMicros)]);
+    bump(shard.diskLatencySum, latencyMicros);
+}
+
+StatsSnapshot Stats::snapshot()
+{
+    StatsSnapshot merged;
+
+    lock_guard<mutex> lock(mtx);
+
+    for (auto &shard : shards)
+    {
+        merged.completed += shard->completed.load(memory_order_acquire);
+        merged.started += shard->started.load(memory_order_relaxed);
+        merged.errors += shard->errors.load(memory_order_relaxed);
+        merged.rejected += shard->rejected.load(memory_order_relaxed);
+        merged.latencySum += shard->latencySum.load(memory_order_relaxed);
+        merged.bytesIn += shard->bytesIn.load(memory_order_relaxed);
+        merged.bytesOut += shard->bytesOut.load(memory_order_relaxed);
+        merged.diskLatencySum += shard->diskLatencySum.load(memory_order_relaxed);
+
+        for (int m = 0; m < HTTP_METHOD_COUNT; m++)
+            for (int c = 0; c < STATUS_CLASSES; c++)
+                merged.calls[m][c] += shard->calls[m][c].load(memory_order_relaxed);
+
+        for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            merged.latency[i] += shard->latency[i].load(memory_order_relaxed);
+            merged.diskLatency[i] += shard->diskLatency[i].load(memory_order_relaxed);
+        }
+    }
+
+    return merged;
+}
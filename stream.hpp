@@ -0,0 +1,177 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include "libs/httplib.h"
+
+using namespace std;
+
+// Hands an upstream response from the thread reading it to the server
+// worker writing it downstream. At most `capacity` body chunks are held at
+// once; the upstream side blocks until the client catches up. Its chunks
+// alone carry a streamed request body the other way.
+class StreamRelay
+{
+private:
+    size_t capacity;
+    deque<string> chunks;
+
+    bool headersReady = false;
+    bool finished = false;
+    bool cancelled = false;
+    bool closed = false;
+    string error;
+
+    mutex mtx;
+    condition_variable changed;
+
+public:
+    int status = -1;
+    string reason;
+    httplib::Headers headers;
+
+    explicit StreamRelay(size_t c);
+
+    // Upstream side
+    void setResponse(const httplib::Response &response);
+    bool push(const char *data, size_t length);
+    void finish(string err = "");
+    // The upstream side is done with the relay
+    void close();
+
+    // Downstream side
+    bool waitResponse();
+    bool pop(string &chunk);
+    void cancel();
+    void waitClosed();
+
+    string getError();
+};
+
+StreamRelay::StreamRelay(size_t c)
+{
+    capacity = c > 0 ? c : 1;
+}
+
+void StreamRelay::setResponse(const httplib::Response &response)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        status = response.status;
+        reason = response.reason;
+        headers = response.headers;
+        headersReady = true;
+    }
+    changed.notify_all();
+}
+
+bool StreamRelay::push(const char *data, size_t length)
+{
+    unique_lock<mutex> lock(mtx);
+    changed.wait(lock, [&]
+                 { return cancelled || chunks.size() < capacity; });
+
+    if (cancelled)
+        return false;
+
+    chunks.emplace_back(data, length);
+    lock.unlock();
+    changed.notify_all();
+    return true;
+}
+
+void StreamRelay::finish(string err)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        finished = true;
+        error = err;
+    }
+    changed.notify_all();
+}
+
+void StreamRelay::close()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+    }
+    changed.notify_all();
+}
+
+bool StreamRelay::waitResponse()
+{
+    unique_lock<mutex> lock(mtx);
+    changed.wait(lock, [&]
+                 { return headersReady || finished; });
+    return headersReady;
+}
+
+bool StreamRelay::pop(string &chunk)
+{
+    unique_lock<mutex> lock(mtx);
+    changed.wait(lock, [&]
+                 { return !chunks.empty() || finished || cancelled; });
+
+    if (chunks.empty())
+        return false;
+
+    chunk = move(chunks.front());
+    chunks.pop_front();
+    lock.unlock();
+    changed.notify_all();
+    return true;
+}
+
+void StreamRelay::cancel()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        cancelled = true;
+    }
+    changed.notify_all();
+}
+
+void StreamRelay::waitClosed()
+{
+    unique_lock<mutex> lock(mtx);
+    changed.wait(lock, [&]
+                 { return closed; });
+}
+
+string StreamRelay::getError()
+{
+    lock_guard<mutex> lock(mtx);
+    return error;
+}
+
+// Threads reading upstream responses for StreamRelays, joined once the
+// queued relays are done
+class RelayPool
+{
+private:
+    httplib::ThreadPool pool;
+
+public:
+    explicit RelayPool(size_t threads);
+    RelayPool(const RelayPool &) = delete;
+    ~RelayPool();
+
+    void run(function<void()> fn);
+};
+
+RelayPool::RelayPool(size_t threads) : pool(threads > 0 ? threads : 1)
+{
+}
+
+RelayPool::~RelayPool()
+{
+    pool.shutdown();
+}
+
+void RelayPool::run(function<void()> fn)
+{
+    pool.enqueue(move(fn));
+}
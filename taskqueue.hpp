@@ -0,0 +1,298 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "libs/httplib.h"
+
+using namespace std;
+
+// How many connections may wait for the rejector before they are closed
+// without a response
+const size_t REJECT_QUEUE_SIZE = 256;
+
+// Server task queue with a fixed number of workers and at most
+// `maxQueued` connections waiting for one. Connections beyond that go to a
+// single rejector thread, which serves them with isRejecting() set so the
+// pre-routing handler can answer 503 without forwarding.
+//
+// Workers share one queue, like httplib's ThreadPool. With `stealing`,
+// each owns a deque instead: the accept thread deals connections
+// round-robin and an idle worker steals the oldest task of another, so
+// workers don't contend on a single lock.
+class BoundedTaskQueue : public httplib::TaskQueue
+{
+private:
+    struct alignas(64) WorkerDeque
+    {
+        mutex mtx;
+        deque<function<void()>> tasks;
+    };
+
+    size_t maxQueued;
+    bool stealing;
+
+    // Shared queue, guarded by mtx
+    deque<function<void()>> jobs;
+
+    vector<unique_ptr<WorkerDeque>> deques;
+    // Signed, since a worker can take a task before it is counted
+    atomic<long> queued{0};
+    atomic<size_t> nextDeque{0};
+    atomic<int> sleepers{0};
+    atomic<bool> stopping{false};
+
+    deque<function<void()>> rejects;
+    vector<thread> threads;
+
+    mutex mtx;
+    condition_variable jobReady;
+    condition_variable rejectReady;
+
+    bool take(size_t self, function<void()> &fn);
+    void work();
+    void workStealing(size_t self);
+    void reject();
+
+public:
+    BoundedTaskQueue(size_t workers, size_t queued, bool stealTasks);
+    BoundedTaskQueue(const BoundedTaskQueue &) = delete;
+
+    bool enqueue(function<void()> fn) override;
+    void shutdown() override;
+
+    // True on the rejector thread
+    static bool isRejecting();
+};
+
+// Server for a BoundedTaskQueue. The rejector serves each connection for
+// a single request, so a client keeping it open can't hold the rejector.
+class BoundedServer : public httplib::Server
+{
+private:
+    bool process_and_close_socket(socket_t sock) override;
+
+public:
+    // Closes the connection once `res` is written, for handlers that leave
+    // some of the request body unread
+    static void closeConnection(httplib::Response &res);
+};
+
+thread_local bool rejectingTasks = false;
+thread_local bool closingConnection = false;
+
+BoundedTaskQueue::BoundedTaskQueue(size_t workers, size_t queued, bool stealTasks)
+{
+    maxQueued = queued;
+    stealing = stealTasks;
+
+    size_t count = workers > 0 ? workers : 1;
+    for (size_t i = 0; stealing && i < count; i++)
+        deques.push_back(make_unique<WorkerDeque>());
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (stealing)
+            threads.emplace_back([this, i]
+                                 { workStealing(i); });
+        else
+            threads.emplace_back([this]
+                                 { work(); });
+    }
+
+    threads.emplace_back([this]
+                         { reject(); });
+}
+
+bool BoundedTaskQueue::enqueue(function<void()> fn)
+{
+    if (!stealing)
+    {
+        lock_guard<mutex> lock(mtx);
+
+        if (maxQueued == 0 || jobs.size() < maxQueued)
+        {
+            jobs.push_back(move(fn));
+            jobReady.notify_one();
+            return true;
+        }
+    }
+    else if (maxQueued == 0 || queued < (long)maxQueued)
+    {
+        WorkerDeque &target = *deques[nextDeque++ % deques.size()];
+        {
+            lock_guard<mutex> lock(target.mtx);
+            target.tasks.push_back(move(fn));
+        }
+
+        // Counted after the push, so workers never spin on a task that is
+        // not there yet; a worker may briefly take it first
+        queued++;
+
+        if (sleepers > 0)
+        {
+            lock_guard<mutex> lock(mtx);
+            jobReady.notify_one();
+        }
+        return true;
+    }
+
+    {
+        lock_guard<mutex> lock(mtx);
+        if (rejects.size() >= REJECT_QUEUE_SIZE)
+            return false;
+
+        rejects.push_back(move(fn));
+    }
+
+    rejectReady.notify_one();
+    return true;
+}
+
+// Own deque first, then another one, oldest task first so the
+// connections waiting longest are served first
+bool BoundedTaskQueue::take(size_t self, function<void()> &fn)
+{
+    {
+        WorkerDeque &own = *deques[self];
+        lock_guard<mutex> lock(own.mtx);
+        if (!own.tasks.empty())
+        {
+            fn = move(own.tasks.front());
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < deques.size(); i++)
+    {
+        WorkerDeque &victim = *deques[(self + i) % deques.size()];
+        lock_guard<mutex> lock(victim.mtx);
+        if (!victim.tasks.empty())
+        {
+            fn = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void BoundedTaskQueue::work()
+{
+    while (true)
+    {
+        function<void()> fn;
+        {
+            unique_lock<mutex> lock(mtx);
+            jobReady.wait(lock, [&]
+                          { return stopping || !jobs.empty(); });
+
+            if (jobs.empty())
+                break;
+
+            fn = move(jobs.front());
+            jobs.pop_front();
+        }
+
+        fn();
+    }
+}
+
+void BoundedTaskQueue::workStealing(size_t self)
+{
+    while (true)
+    {
+        function<void()> fn;
+
+        if (queued > 0 && take(self, fn))
+        {
+            queued--;
+            fn();
+            continue;
+        }
+
+        if (stopping && queued <= 0)
+            break;
+
+        unique_lock<mutex> lock(mtx);
+        sleepers++;
+        if (queued <= 0 && !stopping)
+            jobReady.wait_for(lock, chrono::milliseconds(100));
+        sleepers--;
+    }
+}
+
+void BoundedTaskQueue::reject()
+{
+    rejectingTasks = true;
+
+    while (true)
+    {
+        function<void()> fn;
+        {
+            unique_lock<mutex> lock(mtx);
+            rejectReady.wait(lock, [&]
+                             { return stopping || !rejects.empty(); });
+
+            if (rejects.empty())
+                break;
+
+            fn = move(rejects.front());
+            rejects.pop_front();
+        }
+
+        fn();
+    }
+}
+
+void BoundedTaskQueue::shutdown()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+
+    jobReady.notify_all();
+    rejectReady.notify_all();
+
+    for (auto &t : threads)
+        t.join();
+}
+
+bool BoundedTaskQueue::isRejecting()
+{
+    return rejectingTasks;
+}
+
+bool BoundedServer::process_and_close_socket(socket_t sock)
+{
+    size_t maxCount = BoundedTaskQueue::isRejecting() ? 1 : keep_alive_max_count_;
+
+    bool ret = httplib::detail::process_server_socket(
+        svr_sock_, sock, maxCount, keep_alive_timeout_sec_, read_timeout_sec_, read_timeout_usec_, write_timeout_sec_, write_timeout_usec_,
+        [this](httplib::Stream &strm, bool closeConnection, bool &connectionClosed)
+        {
+            closingConnection = false;
+            bool ok = process_request(strm, closeConnection, connectionClosed, nullptr);
+            connectionClosed = connectionClosed || closingConnection;
+            return ok;
+        });
+
+    httplib::detail::shutdown_socket(sock);
+    httplib::detail::close_socket(sock);
+    return ret;
+}
+
+void BoundedServer::closeConnection(httplib::Response &res)
+{
+    closingConnection = true;
+    res.set_header("Connection", "close");
+}
@@ -1,8 +1,9 @@
 #include "libs/termbox2.h"
+#include "record.hpp"
 
 using namespace std;
 
-const int fixedLines = 11;
+const int fixedLines = 12;
 
 const char X_ICON[4] = "✗";
 const char UP_ICON[4] = "↑";
@@ -14,15 +15,19 @@ int maxRecordLines(int height)
     return freeLines > 0 ? freeLines : 0;
 }
 
-int methodColor(string method)
+int methodColor(HttpMethod method)
 {
-    if (method == "GET")
+    switch (method)
+    {
+    case HttpMethod::Get:
         return TB_GREEN;
-    if (method == "POST")
+    case HttpMethod::Post:
         return TB_YELLOW;
-    if (method == "PUT")
+    case HttpMethod::Put:
         return TB_BLUE;
-    if (method == "DELETE")
+    case HttpMethod::Delete:
         return TB_RED;
-    return TB_WHITE;
+    default:
+        return TB_WHITE;
+    }
 }
@@ -1,13 +1,18 @@
+#pragma once
+
 #include <iostream>
 #include <string>
 #include <ctime>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 
 using namespace std;
 
-string currentTimeStr()
+string timeStr(time_t t)
 {
-  time_t t = time(0);
-  tm *now = localtime(&t);
+  tm local;
+  tm *now = localtime_r(&t, &local);
   string hr = to_string(now->tm_hour);
   hr = hr.length() == 1 ? "0" + hr : hr;
   string mn = to_string(now->tm_min);
@@ -18,10 +23,10 @@ string currentTimeStr()
   return hr + ":" + mn + ":" + sc;
 }
 
-string currentDateStr()
+string dateStr(time_t t)
 {
-  time_t t = time(0);
-  tm *now = localtime(&t);
+  tm local;
+  tm *now = localtime_r(&t, &local);
   string year = to_string(now->tm_year + 1900);
   string month = to_string(now->tm_mon + 1);
   month = month.length() == 1 ? "0" + month : month;
@@ -30,3 +35,64 @@ string currentDateStr()
 
   return year + "-" + month + "-" + day;
 }
+
+string currentTimeStr()
+{
+  return timeStr(time(0));
+}
+
+string currentDateStr()
+{
+  return dateStr(time(0));
+}
+
+// Wall clock time in milliseconds since the epoch
+int64_t nowMillis()
+{
+  return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+uint32_t elapsedMicros(chrono::steady_clock::time_point since)
+{
+  return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - since).count();
+}
+
+// Escapes a string for use inside JSON double quotes
+string jsonEscape(const string &text)
+{
+  string escaped;
+  escaped.reserve(text.size() + 8);
+
+  for (unsigned char c : text)
+  {
+    switch (c)
+    {
+    case '"':
+      escaped += "\\\"";
+      break;
+    case '\\':
+      escaped += "\\\\";
+      break;
+    case '\n':
+      escaped += "\\n";
+      break;
+    case '\r':
+      escaped += "\\r";
+      break;
+    case '\t':
+      escaped += "\\t";
+      break;
+    default:
+      if (c < 0x20)
+      {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        escaped += buf;
+      }
+      else
+        escaped += c;
+    }
+  }
+
+  return escaped;
+}
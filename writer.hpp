@@ -0,0 +1,396 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "accounting.hpp"
+#include "logduto.hpp"
+#include "queue.hpp"
+#include "segment.hpp"
+#include "stats.hpp"
+
+using namespace std;
+
+// What to do when the log queue is full
+enum class Backpressure
+{
+    Block,
+    DropOldest,
+    DropNewest
+};
+
+Backpressure backpressureFromString(string policy);
+
+// Bytes of a streamed log that may wait for the writers before the stream
+// blocks or its log is dropped, depending on the policy
+const size_t STREAM_LOG_BYTES = 4 << 20;
+
+class LogWriter;
+
+// The log of a request whose bodies are streamed, written piece by piece
+// as they pass through. Pieces queue up here and whichever writer thread
+// picks the stream up applies them in order.
+class StreamLog : public enable_shared_from_this<StreamLog>
+{
+    friend class LogWriter;
+
+private:
+    LogWriter *writer;
+    Logduto logduto;
+
+    mutex mtx;
+    condition_variable drained;
+    deque<function<void(Logduto &)>> pending;
+    size_t pendingBytes = 0;
+    // A task for the stream is in the writer's queue
+    bool queued = false;
+    bool dropped = false;
+
+    void enqueue(function<void(Logduto &)> piece, size_t bytes);
+    void drop();
+
+public:
+    StreamLog(LogWriter *w, Logduto l);
+    StreamLog(const StreamLog &) = delete;
+
+    void requestBody(const char *data, size_t length);
+    void response(ResData res);
+    void responseBody(const char *data, size_t length);
+    void end();
+};
+
+// A unit of work for the log writer, immutable once enqueued: a whole
+// log, or the pending pieces of a streamed one
+struct LogTask
+{
+    Logduto logduto;
+    shared_ptr<StreamLog> stream;
+};
+
+// Moves file I/O off the request path: handlers enqueue tasks and writer
+// threads drain them in batches.
+class LogWriter
+{
+    friend class StreamLog;
+
+private:
+    BoundedQueue<LogTask> queue;
+    Backpressure policy;
+    SegmentStore *segments;
+    Stats *stats;
+    LogAccounting *accounting;
+    vector<thread> threads;
+
+    atomic<bool> stopping{false};
+    atomic<uint64_t> dropped{0};
+    atomic<int> sleepers{0};
+
+    mutex mtx;
+    condition_variable notEmpty;
+    condition_variable notFull;
+
+    bool push(LogTask task);
+    void drop(LogTask &task);
+    void run();
+    void writeBatch(vector<LogTask> &batch);
+    void writeStream(StreamLog &stream);
+    void endStream(Logduto &logduto);
+
+public:
+    static const size_t batchSize = 64;
+
+    // Records go to `s` when given, to per-request .log files otherwise.
+    // Write latencies are reported to `st` and written files to `a` when
+    // given.
+    LogWriter(size_t capacity, Backpressure p, int writers, SegmentStore *s, Stats *st, LogAccounting *a);
+    LogWriter(const LogWriter &) = delete;
+    ~LogWriter();
+
+    // Writes the request log file and data dumps
+    void save(Logduto logduto);
+
+    // Starts the log of a streamed request
+    shared_ptr<StreamLog> beginStream(Logduto logduto);
+
+    // Drains the queue and joins the writer threads
+    void stop();
+
+    uint64_t droppedCount();
+    size_t depth();
+};
+
+Backpressure backpressureFromString(string policy)
+{
+    if (policy == "block")
+        return Backpressure::Block;
+    if (policy == "drop-oldest")
+        return Backpressure::DropOldest;
+    if (policy == "drop-newest")
+        return Backpressure::DropNewest;
+    throw runtime_error("Unknown log policy: " + policy + "\n");
+}
+
+StreamLog::StreamLog(LogWriter *w, Logduto l) : writer(w), logduto(move(l))
+{
+}
+
+void StreamLog::enqueue(function<void(Logduto &)> piece, size_t bytes)
+{
+    unique_lock<mutex> lock(mtx);
+
+    while (!dropped && !pending.empty() && pendingBytes + bytes > STREAM_LOG_BYTES)
+    {
+        if (writer->policy != Backpressure::Block || writer->stopping)
+        {
+            lock.unlock();
+            drop();
+            writer->dropped++;
+            return;
+        }
+        drained.wait_for(lock, chrono::milliseconds(10));
+    }
+
+    if (dropped)
+        return;
+
+    pending.push_back(move(piece));
+    pendingBytes += bytes;
+
+    if (queued)
+        return;
+    queued = true;
+    lock.unlock();
+
+    LogTask task;
+    task.stream = shared_from_this();
+    writer->push(move(task));
+}
+
+// What was written so far stays on disk, unaccounted
+void StreamLog::drop()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        dropped = true;
+        queued = false;
+        pending.clear();
+        pendingBytes = 0;
+    }
+    drained.notify_all();
+}
+
+void StreamLog::requestBody(const char *data, size_t length)
+{
+    enqueue([chunk = string(data, length)](Logduto &l)
+            { l.streamRequestBody(chunk.data(), chunk.size()); },
+            length);
+}
+
+void StreamLog::response(ResData res)
+{
+    enqueue([res = move(res)](Logduto &l)
+            { l.streamResponse(res); },
+            0);
+}
+
+void StreamLog::responseBody(const char *data, size_t length)
+{
+    enqueue([chunk = string(data, length)](Logduto &l)
+            { l.streamResponseBody(chunk.data(), chunk.size()); },
+            length);
+}
+
+void StreamLog::end()
+{
+    enqueue([this](Logduto &l)
+            { writer->endStream(l); },
+            0);
+}
+
+LogWriter::LogWriter(size_t capacity, Backpressure p, int writers, SegmentStore *s, Stats *st, LogAccounting *a) : queue(capacity), policy(p), segments(s), stats(st), accounting(a)
+{
+    for (int i = 0; i < (writers > 0 ? writers : 1); i++)
+    {
+        threads.emplace_back([this]
+                             { run(); });
+    }
+}
+
+LogWriter::~LogWriter()
+{
+    stop();
+}
+
+void LogWriter::save(Logduto logduto)
+{
+    LogTask task;
+    task.logduto = move(logduto);
+    push(move(task));
+}
+
+shared_ptr<StreamLog> LogWriter::beginStream(Logduto logduto)
+{
+    auto stream = make_shared<StreamLog>(this, move(logduto));
+    stream->enqueue([](Logduto &l)
+                    { l.beginStream(); },
+                    0);
+    return stream;
+}
+
+// False if the task was dropped
+bool LogWriter::push(LogTask task)
+{
+    while (!queue.tryPush(move(task)))
+    {
+        if (policy == Backpressure::DropNewest || stopping)
+        {
+            drop(task);
+            return false;
+        }
+
+        if (policy == Backpressure::DropOldest)
+        {
+            LogTask oldest;
+            if (queue.tryPop(oldest))
+                drop(oldest);
+            continue;
+        }
+
+        unique_lock<mutex> lock(mtx);
+        notFull.wait_for(lock, chrono::milliseconds(10));
+    }
+
+    if (sleepers > 0)
+        notEmpty.notify_one();
+    return true;
+}
+
+// A streamed log loses all of its pieces, since later ones need the
+// earlier ones
+void LogWriter::drop(LogTask &task)
+{
+    if (task.stream)
+        task.stream->drop();
+    dropped++;
+}
+
+void LogWriter::run()
+{
+    vector<LogTask> batch;
+    batch.reserve(batchSize);
+
+    while (true)
+    {
+        LogTask task;
+        while (batch.size() < batchSize && queue.tryPop(task))
+            batch.push_back(move(task));
+
+        if (batch.empty())
+        {
+            if (stopping)
+                break;
+
+            unique_lock<mutex> lock(mtx);
+            sleepers++;
+            notEmpty.wait_for(lock, chrono::milliseconds(100));
+            sleepers--;
+            continue;
+        }
+
+        if (policy == Backpressure::Block)
+            notFull.notify_all();
+
+        writeBatch(batch);
+        batch.clear();
+    }
+}
+
+void LogWriter::writeBatch(vector<LogTask> &batch)
+{
+    for (auto &task : batch)
+    {
+        if (task.stream)
+        {
+            writeStream(*task.stream);
+            continue;
+        }
+
+        auto started = chrono::steady_clock::now();
+
+        if (segments)
+        {
+            segments->append(task.logduto);
+            task.logduto.saveDataFiles();
+        }
+        else
+        {
+            uint64_t size = task.logduto.saveToFile();
+            if (accounting && size > 0)
+                accounting->add(task.logduto.getLogPath(), httpMethodFromString(task.logduto.getMethod()), size, task.logduto.getCreatedMs());
+        }
+
+        if (stats)
+            stats->diskWrite(elapsedMicros(started));
+    }
+}
+
+// Applies pieces until the stream has none left, so it is queued again by
+// the next one
+void LogWriter::writeStream(StreamLog &stream)
+{
+    deque<function<void(Logduto &)>> pieces;
+
+    while (true)
+    {
+        {
+            lock_guard<mutex> lock(stream.mtx);
+            if (stream.pending.empty() || stream.dropped)
+            {
+                stream.queued = false;
+                return;
+            }
+            pieces.swap(stream.pending);
+            stream.pendingBytes = 0;
+        }
+        stream.drained.notify_all();
+
+        for (auto &piece : pieces)
+            piece(stream.logduto);
+        pieces.clear();
+    }
+}
+
+void LogWriter::endStream(Logduto &logduto)
+{
+    uint64_t size = logduto.endStream();
+    if (accounting && size > 0)
+        accounting->add(logduto.getLogPath(), httpMethodFromString(logduto.getMethod()), size, logduto.getCreatedMs());
+}
+
+void LogWriter::stop()
+{
+    if (stopping.exchange(true))
+        return;
+
+    notEmpty.notify_all();
+    notFull.notify_all();
+
+    for (auto &t : threads)
+        t.join();
+}
+
+uint64_t LogWriter::droppedCount()
+{
+    return dropped;
+}
+
+size_t LogWriter::depth()
+{
+    return queue.size();
+}